@@ -1,3 +1,5 @@
+import threading
+from concurrent.futures import Future, ThreadPoolExecutor
 from typing import NamedTuple
 
 import numpy as np
@@ -6,11 +8,239 @@ from numpy.typing import NDArray
 from ._ext import ctc_decode
 
 
+def set_num_threads(num_threads: int) -> None:
+    """
+    Size the thread pool shared by all decoders, 0 means one thread per core.
+    Must be called before the first decode, afterwards the pool is fixed.
+    """
+    ctc_decode.set_num_threads(num_threads)
+
+
+def get_num_threads() -> int:
+    return ctc_decode.get_num_threads()
+
+
+def convert_language_model(arpa_path: str, binary_path: str) -> None:
+    """
+    Write the n-gram model of an ARPA file in the binary format of ctcdecode, which decoders memory map rather than
+    parse. Like snapshots, it is only read by the same version of ctcdecode, on a machine of the same byte order.
+    """
+    ctc_decode.convert_language_model(arpa_path, binary_path)
+
+
 class Candidate(NamedTuple):
     value: list[int]
     log_prob: float
 
 
+class TimedCandidate(NamedTuple):
+    value: list[int]
+    timesteps: list[int]
+    log_prob: float
+
+
+class PackedCandidates(NamedTuple):
+    """
+    Candidates of a batch in a few arrays. Candidate i of utterance b is tokens[offsets[b, i] : offsets[b, i] +
+    lengths[b, i]], emitted at frames timesteps[same slice], with log probability log_probs[b, i]. Utterances with
+    fewer candidates than others are padded with empty candidates of log probability -inf.
+    """
+
+    tokens: NDArray[np.int32]
+    timesteps: NDArray[np.int32]
+    offsets: NDArray[np.int64]
+    lengths: NDArray[np.int32]
+    log_probs: NDArray[np.float32]
+
+    def candidate(self, batch_index: int, index: int) -> TimedCandidate:
+        begin = self.offsets[batch_index, index]
+        end = begin + self.lengths[batch_index, index]
+        return TimedCandidate(
+            self.tokens[begin:end].tolist(),
+            self.timesteps[begin:end].tolist(),
+            float(self.log_probs[batch_index, index]),
+        )
+
+
+class Lattice(NamedTuple):
+    """
+    Candidates of an utterance as a prefix tree whose nodes are shared by the candidates with a common prefix, e.g.
+    for rescoring without going over the shared prefixes again. Node n holds tokens[n], emitted at frame
+    timesteps[n], after node parents[n], -1 for a first token. A node comes after its parent. log_probs[n] is the
+    log probability of the best candidate going through the node. Candidate i, best first, ends at node
+    candidates[i], -1 for the empty candidate, and has log probability candidate_log_probs[i].
+    """
+
+    tokens: NDArray[np.int32]
+    timesteps: NDArray[np.int32]
+    parents: NDArray[np.int32]
+    log_probs: NDArray[np.float32]
+    candidates: NDArray[np.int32]
+    candidate_log_probs: NDArray[np.float32]
+
+    def candidate(self, index: int) -> TimedCandidate:
+        nodes = []
+        node = self.candidates[index]
+        while node >= 0:
+            nodes.append(node)
+            node = self.parents[node]
+        nodes.reverse()
+        return TimedCandidate(
+            self.tokens[nodes].tolist(), self.timesteps[nodes].tolist(), float(self.candidate_log_probs[index])
+        )
+
+
+class Segment(NamedTuple):
+    begin_frame: int
+    end_frame: int
+    candidates: list[TimedCandidate]
+
+
+def _to_candidates(outputs: list[tuple[list[int], list[int], float]]) -> list[TimedCandidate]:
+    return [TimedCandidate(value, timesteps, -score) for value, timesteps, score in outputs]
+
+
+def _to_segments(segments: list[tuple[int, int, list[tuple[list[int], list[int], float]]]]) -> list[Segment]:
+    return [Segment(begin, end, _to_candidates(outputs)) for begin, end, outputs in segments]
+
+
+class StreamingDecoder:
+    """
+    Decodes one utterance chunk by chunk, keeping the beam between chunks so that every frame is only processed once.
+    Create it with CTCBeamDecoder.stream().
+    """
+
+    def __init__(self, options: ctc_decode.DecoderOptions):
+        self._decoder = ctc_decode.StreamingDecoder(options)
+
+    def next(self, log_probs: NDArray[np.float32]) -> list[Segment]:
+        """
+        Decode the next frames, log_probs being of shape time x label_size. A float32 array is read in place, strided
+        slices included, and the GIL is released meanwhile.
+        Returns the segments ended by an endpoint in these frames, with their final candidates, see
+        CTCBeamDecoder's endpoint_blank_frames.
+        """
+        return _to_segments(self._decoder.next(log_probs))
+
+    def decode(self, uncommitted_only: bool = False, num_results: int | None = None) -> list[TimedCandidate]:
+        """
+        Best candidates of the current segment, i.e. of the frames since the last endpoint, with the frame of each
+        token counted from the start of the stream. Decoding can go on afterwards. With uncommitted_only, the
+        committed tokens are left out of the candidates, which keeps the cost of a call independent of the length of
+        the stream.
+        With num_results, only that many of the best candidates are returned, for partial results polled while
+        streaming: the beam is only partially sorted, and not at all for the best one. Candidates of equal score may
+        then come out in another order.
+        """
+        return _to_candidates(self._decoder.decode(uncommitted_only, num_results or 0))
+
+    def decode_lattice(self) -> Lattice:
+        """Candidates of decode(), in the same order, as a Lattice."""
+        return Lattice(*self._decoder.decode_lattice())
+
+    def pop_committed(self) -> tuple[list[int], list[int]]:
+        """
+        Tokens, and their frames, of the current segment committed since the last call. Every candidate starts with
+        the committed tokens, so they are final and can be shown as such.
+        """
+        return self._decoder.pop_committed()
+
+    def reset(self) -> None:
+        """Forget the frames seen so far and start a new utterance."""
+        self._decoder.reset()
+
+    def snapshot(self) -> bytes:
+        """
+        Compact binary copy of the decoder, with its settings, e.g. to move a live stream to another process.
+        Restoring it is far cheaper than decoding the stream again. Snapshots can only be restored by the same version
+        of ctcdecode, on a machine of the same byte order. A lexicon is referred to by its path, where it must also be
+        found on restore, and so is a language model.
+        """
+        return self._decoder.snapshot()
+
+    @classmethod
+    def restore(cls, snapshot: bytes) -> "StreamingDecoder":
+        """Decoder from a snapshot, decoding goes on exactly as it would have in the decoder it was taken of."""
+        decoder = cls.__new__(cls)
+        decoder._decoder = ctc_decode.StreamingDecoder.restore(snapshot)
+        return decoder
+
+    def __reduce__(self):
+        return StreamingDecoder.restore, (self.snapshot(),)
+
+    @property
+    def num_frames(self) -> int:
+        return self._decoder.num_frames
+
+    @property
+    def segment_begin(self) -> int:
+        """First frame of the current segment."""
+        return self._decoder.segment_begin
+
+
+class StreamUpdate(NamedTuple):
+    stream_id: int
+    num_frames: int
+    final: bool
+    candidates: list[TimedCandidate]
+    error: str | None
+    segments: list[Segment]
+
+
+class StreamManager:
+    """
+    Decodes many live streams at once without a thread per stream. Chunks pushed for any stream are queued, and a
+    background thread decodes the streams with queued chunks in micro-batches on the shared thread pool.
+    Create it with CTCBeamDecoder.stream_manager().
+    """
+
+    def __init__(
+        self, options: ctc_decode.DecoderOptions, max_batch_streams: int, num_processes: int, max_results: int
+    ):
+        self._manager = ctc_decode.StreamManager(options, max_batch_streams, num_processes, max_results)
+
+    def push(self, stream_id: int, log_probs: NDArray[np.float32]) -> None:
+        """
+        Queue the next frames of a stream, of shape time x label_size, starting the stream if it's new.
+        log_probs is copied, it can be reused right away.
+        """
+        self._manager.push(stream_id, log_probs)
+
+    def finish(self, stream_id: int) -> None:
+        """End a stream, its next update is final and the id can be reused afterwards."""
+        self._manager.finish(stream_id)
+
+    def poll(self, timeout: float = 0.0) -> list[StreamUpdate]:
+        """
+        Latest results of every stream decoded further since the last poll, waiting up to timeout seconds for one.
+        The candidates are those of the current segment, the segments ended since the last poll are all included.
+        A stream whose decoding failed gets a final update with the error.
+        """
+        return [
+            StreamUpdate(stream_id, num_frames, final, _to_candidates(outputs), error or None, _to_segments(segments))
+            for stream_id, num_frames, final, outputs, error, segments in self._manager.poll(timeout)
+        ]
+
+    def flush(self) -> None:
+        """Wait until every queued chunk is decoded."""
+        self._manager.flush()
+
+    def snapshot(self, stream_id: int) -> bytes:
+        """
+        Binary copy of a stream once its queued chunks are decoded, see StreamingDecoder.snapshot. The stream goes on
+        here, e.g. until the process taking it over has restored it.
+        """
+        return self._manager.snapshot(stream_id)
+
+    def restore(self, stream_id: int, snapshot: bytes) -> None:
+        """Start a stream from a snapshot taken by this manager or another one, it keeps the settings it had there."""
+        self._manager.restore(stream_id, snapshot)
+
+    @property
+    def num_streams(self) -> int:
+        return self._manager.num_streams
+
+
 class CTCBeamDecoder:
     def __init__(
         self,
@@ -19,12 +249,99 @@ class CTCBeamDecoder:
         beam_width: int = 100,
         num_processes: int = 4,
         blank_id: int = 0,
+        engine: str = "trie",
+        merge_mode: str = "exact",
+        blank_skip_threshold: float = 1.0,
+        beam_threshold: float = float("inf"),
+        num_expansion_threads: int = 1,
+        segment_blank_frames: int = 0,
+        segment_blank_threshold: float = 0.999,
+        max_uncommitted_frames: int = 0,
+        endpoint_blank_frames: int = 0,
+        endpoint_blank_threshold: float = 0.99,
+        endpoint_score_margin: float = 0.0,
+        lexicon: str | None = None,
+        model_path: str | None = None,
+        labels: list[str] | None = None,
+        alpha: float = 0.0,
+        beta: float = 0.0,
+        separator_id: int = -1,
     ):
+        """
+        engine picks the data structure holding the beam, both give the same results:
+        "trie" keeps prefixes in a pointer-linked trie, "hashed" keeps them in flat arrays merged through a hash table,
+        which is faster for large beams and vocabularies.
+        merge_mode picks how path probabilities are added up: "exact", "fast", which is within 1e-6 of it in log
+        space and a lot cheaper, or "max", which scores a prefix by its best alignment (Viterbi) instead of the sum over
+        all of them and is cheaper still.
+        Frames whose blank probability is at least blank_skip_threshold aren't expanded, which saves most of the work
+        on silence. The default of 1.0 expands every frame.
+        beam_threshold drops the prefixes scoring more than that much below the best one (in log probability), so
+        that the beam shrinks below beam_width on easy frames. It can't be negative.
+        num_expansion_threads lets up to that many threads of the shared pool expand the beam of one frame together,
+        which cuts the latency of single long utterances with large beams and vocabularies. It only applies to the
+        "trie" engine and doesn't change the results.
+        With segment_blank_frames > 0, long inputs are cut in the middle of every run of at least that many frames
+        whose blank probability reaches segment_blank_threshold, the segments are decoded concurrently and their
+        results joined, which brings the latency of long recordings down with the number of cores. Every segment
+        starts from scratch, so it can't be combined with a lexicon or a language model, whose words may span a cut.
+        Streams commit the tokens every candidate starts with and free their state. max_uncommitted_frames > 0 drops
+        the candidates that branched off the best one more than about that many frames ago, which bounds the memory
+        of long streams at the cost of exactness.
+        With endpoint_blank_frames > 0, streams end a segment at every pause of at least that many frames whose blank
+        probability reaches endpoint_blank_threshold, if the best candidate didn't change during it. The candidates
+        of the segment are final, and decoding starts over from scratch, which keeps the memory and cost per frame
+        of a stream flat. With endpoint_score_margin > 0, the best candidate must also lead the second best by at
+        least that much in log probability, so that a segment doesn't end while the beam still hesitates.
+        lexicon is the path of an OpenFST acceptor the candidates are constrained to sequences of words of: a ConstFst
+        over the standard arc type, arc-sorted, where a token is label token + 1 since label 0 is epsilon. A candidate
+        in a final state goes on with its word or starts the next one from the start state, so a word separator token
+        is part of the words. Write it with fstconvert --fst_type=const --fst_align so that it is memory mapped rather
+        than read. The file is loaded once and shared by all decoders, threads and streams using it.
+        model_path is an n-gram language model the candidates are scored with as they grow, either an ARPA file or
+        one written by convert_language_model, which loads faster and is memory mapped. labels gives the label of
+        every token, the model's word for it. With separator_id >= 0 the model is word-level instead: a word is
+        scored when the separator token follows it, spelled with the labels of its tokens. Every scored word adds
+        alpha times its log probability plus beta to the score of the candidate. The model is loaded once and shared
+        like the lexicon.
+        """
+        if engine not in ctc_decode.BeamEngine.__members__:
+            raise ValueError(f"unknown engine {engine!r}")
+        if merge_mode not in ctc_decode.MergeMode.__members__:
+            raise ValueError(f"unknown merge_mode {merge_mode!r}")
+        if not beam_threshold >= 0:
+            raise ValueError(f"beam_threshold must be a non-negative number, not {beam_threshold!r}")
+        if model_path is not None and labels is None:
+            raise ValueError("a language model needs the labels of the tokens")
+        if segment_blank_frames > 0 and (lexicon is not None or model_path is not None):
+            raise ValueError("segment_blank_frames can't be combined with a lexicon or a language model")
+
         self.cutoff_top_n = cutoff_top_n
         self.beam_width = beam_width
+        # upper bound on the shared pool's threads used by one decode call
         self.num_processes = num_processes
         self.blank_id = blank_id
         self.cutoff_prob = cutoff_prob
+        self.engine = engine
+        self.merge_mode = merge_mode
+        self.blank_skip_threshold = blank_skip_threshold
+        self.beam_threshold = beam_threshold
+        self.num_expansion_threads = num_expansion_threads
+        self.segment_blank_frames = segment_blank_frames
+        self.segment_blank_threshold = segment_blank_threshold
+        self.max_uncommitted_frames = max_uncommitted_frames
+        self.endpoint_blank_frames = endpoint_blank_frames
+        self.endpoint_blank_threshold = endpoint_blank_threshold
+        self.endpoint_score_margin = endpoint_score_margin
+        # loaded here, so that a bad file fails now rather than at the first decode
+        self._lexicon = ctc_decode.Lexicon(lexicon) if lexicon is not None else None
+        self._language_model = (
+            ctc_decode.LanguageModel(model_path, labels, separator_id) if model_path is not None else None
+        )
+        self.alpha = alpha
+        self.beta = beta
+        self._executor: ThreadPoolExecutor | None = None
+        self._executor_lock = threading.Lock()
 
     def decode(
         self, log_probs: NDArray[np.float32], seq_lens: NDArray[np.integer] | None = None
@@ -37,15 +354,103 @@ class CTCBeamDecoder:
         if seq_lens is None:
             seq_lens = np.full((batch_size,), max_seq_len, dtype=np.int32)
 
-        out = ctc_decode.beam_decode(
-            log_probs,
-            seq_lens,
-            self.beam_width,
-            self.num_processes,
-            self.cutoff_prob,
-            self.cutoff_top_n,
-            self.blank_id,
-        )
+        out = ctc_decode.beam_decode(log_probs, seq_lens, self.num_processes, self._options())
 
         # convert to named tuples
         return [[Candidate(value, -score) for value, score in batch_out] for batch_out in out]
+
+    def decode_packed(
+        self, log_probs: NDArray[np.float32], seq_lens: NDArray[np.integer] | None = None
+    ) -> PackedCandidates:
+        """
+        Same as decode, with the candidates and the frames of their tokens packed into a few numpy arrays, see
+        PackedCandidates. Large batches and beams then don't create a python object per token and candidate.
+        """
+        batch_size, max_seq_len = log_probs.shape[:2]
+        if seq_lens is None:
+            seq_lens = np.full((batch_size,), max_seq_len, dtype=np.int32)
+
+        packed = ctc_decode.beam_decode_packed(log_probs, seq_lens, self.num_processes, self._options())
+        return PackedCandidates(*packed)
+
+    def decode_lattice(
+        self, log_probs: NDArray[np.float32], seq_lens: NDArray[np.integer] | None = None
+    ) -> list[Lattice]:
+        """
+        Same as decode, with the candidates of every utterance as a Lattice, whose size grows with the number of
+        distinct tokens of the candidates rather than their number times their length. segment_blank_frames doesn't
+        apply.
+        """
+        batch_size, max_seq_len = log_probs.shape[:2]
+        if seq_lens is None:
+            seq_lens = np.full((batch_size,), max_seq_len, dtype=np.int32)
+
+        lattices = ctc_decode.beam_decode_lattice(log_probs, seq_lens, self.num_processes, self._options())
+        return [Lattice(*lattice) for lattice in lattices]
+
+    def _options(self) -> ctc_decode.DecoderOptions:
+        options = ctc_decode.DecoderOptions()
+        options.beam_size = self.beam_width
+        options.cutoff_prob = self.cutoff_prob
+        options.cutoff_top_n = self.cutoff_top_n
+        options.blank_id = self.blank_id
+        options.engine = ctc_decode.BeamEngine.__members__[self.engine]
+        options.merge_mode = ctc_decode.MergeMode.__members__[self.merge_mode]
+        options.blank_skip_threshold = self.blank_skip_threshold
+        options.beam_threshold = self.beam_threshold
+        options.num_expansion_threads = self.num_expansion_threads
+        options.segment_blank_frames = self.segment_blank_frames
+        options.segment_blank_threshold = self.segment_blank_threshold
+        options.max_uncommitted_frames = self.max_uncommitted_frames
+        options.endpoint_blank_frames = self.endpoint_blank_frames
+        options.endpoint_blank_threshold = self.endpoint_blank_threshold
+        options.endpoint_score_margin = self.endpoint_score_margin
+        options.lexicon = self._lexicon
+        options.language_model = self._language_model
+        options.lm_alpha = self.alpha
+        options.lm_beta = self.beta
+        return options
+
+    def stream(self) -> StreamingDecoder:
+        """
+        Start decoding an utterance that arrives in chunks, with the settings of this decoder. segment_blank_frames
+        doesn't apply to streams.
+        """
+        return StreamingDecoder(self._options())
+
+    def stream_manager(self, max_batch_streams: int = 256, max_results: int = 1) -> StreamManager:
+        """
+        Decode many concurrent streams with the settings of this decoder, up to max_batch_streams at a time on at
+        most num_processes threads, reporting the max_results best candidates of each.
+        """
+        return StreamManager(self._options(), max_batch_streams, self.num_processes, max_results)
+
+    def decode_async(
+        self, log_probs: NDArray[np.float32], seq_lens: NDArray[np.integer] | None = None
+    ) -> Future[list[list[Candidate]]]:
+        """
+        Same as decode, but runs on a background thread and returns a Future right away.
+        The GIL is released while decoding, so the caller can run the next forward pass meanwhile.
+        Use asyncio.wrap_future to await the result. log_probs is read in place, don't modify it until the future is done.
+        """
+        with self._executor_lock:
+            if self._executor is None:
+                # a single thread keeps the results in submission order, the decoding itself is multi-threaded
+                self._executor = ThreadPoolExecutor(max_workers=1, thread_name_prefix="ctcdecode")
+            return self._executor.submit(self.decode, log_probs, seq_lens)
+
+    def close(self) -> None:
+        """
+        Wait for the decode_async calls in flight and stop their thread. The decoder can still be used, the next
+        decode_async starts a new one.
+        """
+        with self._executor_lock:
+            executor, self._executor = self._executor, None
+        if executor is not None:
+            executor.shutdown(wait=True)
+
+    def __del__(self):
+        # the pending calls hold a reference to the decoder, so there are none left by now
+        executor = getattr(self, "_executor", None)
+        if executor is not None:
+            executor.shutdown(wait=False)
@@ -1,54 +1,76 @@
 #include "ctc_beam_search_decoder.h"
+#include "decoder_options.h"
+#include "language_model.h"
+#include "lexicon.h"
+#include "log_probs_view.h"
 #include "output.h"
+#include "stream_decoder.h"
+#include "stream_manager.h"
 #include <algorithm>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <pybind11/numpy.h>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 #include <string>
+#include <tuple>
 #include <vector>
 
 using namespace std;
 namespace py = pybind11;
 
-vector<vector<pair<vector<int>, float>>> beam_decode(
-    py::array_t<float> log_probs,
-    py::array_t<int> seq_lens,
-    int beam_size,
-    size_t num_processes,
-    float cutoff_prob,
-    size_t cutoff_top_n,
-    size_t blank_id)
+// views over the utterances of a (batch, time, classes) array, read in place
+vector<LogProbsView> batch_views(const py::array_t<float>& log_probs, const py::array_t<int>& seq_lens)
 {
+    if (log_probs.ndim() != 3)
+        throw py::value_error("log_probs must be a 3-D array of shape (batch, time, classes)");
+
     const int64_t batch_size = log_probs.shape(0);
     const int64_t max_time = log_probs.shape(1);
     const int64_t num_classes = log_probs.shape(2);
 
-    vector<vector<vector<float>>> inputs;
-    auto log_prob_a = log_probs.unchecked<3>();
+    // strides are given in bytes, the decoder works in elements
+    const ptrdiff_t batch_stride = log_probs.strides(0) / static_cast<ptrdiff_t>(sizeof(float));
+    const ptrdiff_t time_stride = log_probs.strides(1) / static_cast<ptrdiff_t>(sizeof(float));
+    const ptrdiff_t class_stride = log_probs.strides(2) / static_cast<ptrdiff_t>(sizeof(float));
+
+    // read the numpy buffer in place, no matter whether it is contiguous or not
+    vector<LogProbsView> inputs;
+    inputs.reserve(batch_size);
+    const float* data = log_probs.data();
     auto seq_len_a = seq_lens.unchecked<1>();
 
     for (int b = 0; b < batch_size; ++b)
     {
         // avoid a crash by ensuring that an erroneous seq_len doesn't have us try to access memory we shouldn't
-        int seq_len = std::min<int>(seq_len_a[b], max_time);
-        vector<vector<float>> temp(seq_len, vector<float>(num_classes));
-        for (int t = 0; t < seq_len; ++t)
-        {
-            for (int n = 0; n < num_classes; ++n)
-            {
-                temp[t][n] = log_prob_a(b, t, n);
-            }
-        }
-        inputs.push_back(temp);
+        int seq_len = std::max<int>(std::min<int>(seq_len_a[b], max_time), 0);
+        inputs.emplace_back(data + b * batch_stride, seq_len, num_classes, time_stride, class_stride);
     }
+    return inputs;
+}
 
-    vector<vector<Output>> batch_results
-        = ctc_beam_search_decoder_batch(inputs, beam_size, num_processes, cutoff_prob, cutoff_top_n, blank_id);
+// n-best of every utterance of a (batch, time, classes) array, decoded on the shared thread pool
+vector<vector<Output>> decode_batch(
+    const py::array_t<float>& log_probs,
+    const py::array_t<int>& seq_lens,
+    size_t num_processes,
+    const DecoderOptions& options)
+{
+    vector<LogProbsView> inputs = batch_views(log_probs, seq_lens);
+    // log_probs keeps the buffer alive and the decoder never touches python objects, so let other threads run
+    py::gil_scoped_release release;
+    return ctc_beam_search_decoder_batch(inputs, num_processes, options);
+}
+
+vector<vector<pair<vector<int>, float>>> beam_decode(
+    py::array_t<float> log_probs, py::array_t<int> seq_lens, size_t num_processes, const DecoderOptions& options)
+{
+    vector<vector<Output>> batch_results = decode_batch(log_probs, seq_lens, num_processes, options);
 
     vector<vector<pair<vector<int>, float>>> output;
-    output.reserve(batch_size);
+    output.reserve(batch_results.size());
 
     for (auto& results : batch_results)
     {
@@ -64,19 +86,436 @@ vector<vector<pair<vector<int>, float>>> beam_decode(
     return output;
 }
 
+/* Same as beam_decode, with the n-best packed into a few numpy arrays instead
+ * of a python object per candidate:
+ *     tokens, timesteps: of every candidate one after the other, int32
+ *     offsets: (batch, num_results) start of every candidate in tokens, int64
+ *     lengths: (batch, num_results) number of tokens of every candidate, int32
+ *     log_probs: (batch, num_results) log probability of every candidate, float32
+ * num_results is the largest number of candidates of an utterance. Utterances
+ * with fewer candidates are padded with empty ones of log probability -inf.
+ */
+py::tuple beam_decode_packed(
+    py::array_t<float> log_probs, py::array_t<int> seq_lens, size_t num_processes, const DecoderOptions& options)
+{
+    vector<vector<Output>> batch_results = decode_batch(log_probs, seq_lens, num_processes, options);
+
+    const size_t batch_size = batch_results.size();
+    size_t num_results = 0;
+    size_t num_tokens = 0;
+    for (auto& results : batch_results)
+    {
+        num_results = max(num_results, results.size());
+        for (auto& result : results)
+            num_tokens += result.tokens.size();
+    }
+
+    const vector<py::ssize_t> shape { static_cast<py::ssize_t>(batch_size), static_cast<py::ssize_t>(num_results) };
+    py::array_t<int32_t> tokens(static_cast<py::ssize_t>(num_tokens));
+    py::array_t<int32_t> timesteps(static_cast<py::ssize_t>(num_tokens));
+    py::array_t<int64_t> offsets(shape);
+    py::array_t<int32_t> lengths(shape);
+    py::array_t<float> scores(shape);
+    int32_t* tokens_data = tokens.mutable_data();
+    int32_t* timesteps_data = timesteps.mutable_data();
+    auto offsets_a = offsets.mutable_unchecked<2>();
+    auto lengths_a = lengths.mutable_unchecked<2>();
+    auto scores_a = scores.mutable_unchecked<2>();
+
+    int64_t offset = 0;
+    for (size_t b = 0; b < batch_size; ++b)
+    {
+        for (size_t i = 0; i < num_results; ++i)
+        {
+            offsets_a(b, i) = offset;
+            if (i >= batch_results[b].size())
+            {
+                lengths_a(b, i) = 0;
+                scores_a(b, i) = -numeric_limits<float>::infinity();
+                continue;
+            }
+
+            const Output& result = batch_results[b][i];
+            copy(result.tokens.begin(), result.tokens.end(), tokens_data + offset);
+            copy(result.timesteps.begin(), result.timesteps.end(), timesteps_data + offset);
+            lengths_a(b, i) = static_cast<int32_t>(result.tokens.size());
+            scores_a(b, i) = -result.score;
+            offset += result.tokens.size();
+        }
+    }
+    return py::make_tuple(tokens, timesteps, offsets, lengths, scores);
+}
+
+template <typename T>
+py::array_t<T> to_array(const vector<T>& values)
+{
+    return py::array_t<T>(static_cast<py::ssize_t>(values.size()), values.data());
+}
+
+// lattice as (tokens, timesteps, parents, log_probs, candidates, candidate_log_probs) numpy arrays
+py::tuple to_lattice(const Lattice& lattice)
+{
+    return py::make_tuple(
+        to_array(lattice.tokens),
+        to_array(lattice.timesteps),
+        to_array(lattice.parents),
+        to_array(lattice.log_probs),
+        to_array(lattice.candidates),
+        to_array(lattice.candidate_log_probs));
+}
+
+// same as beam_decode, with the n-best of every utterance as a lattice
+vector<py::tuple> beam_decode_lattice(
+    py::array_t<float> log_probs, py::array_t<int> seq_lens, size_t num_processes, const DecoderOptions& options)
+{
+    vector<LogProbsView> inputs = batch_views(log_probs, seq_lens);
+    vector<Lattice> lattices;
+    {
+        py::gil_scoped_release release;
+        lattices = ctc_beam_search_lattice_batch(inputs, num_processes, options);
+    }
+
+    vector<py::tuple> output;
+    output.reserve(lattices.size());
+    for (auto& lattice : lattices)
+        output.push_back(to_lattice(lattice));
+    return output;
+}
+
+// view over a (time, classes) numpy array, read in place
+LogProbsView chunk_view(const py::array_t<float>& log_probs)
+{
+    if (log_probs.ndim() != 2)
+        throw py::value_error("log_probs must be a 2-D array of shape (time, classes)");
+
+    return LogProbsView(
+        log_probs.data(),
+        log_probs.shape(0),
+        log_probs.shape(1),
+        log_probs.strides(0) / static_cast<ptrdiff_t>(sizeof(float)),
+        log_probs.strides(1) / static_cast<ptrdiff_t>(sizeof(float)));
+}
+
+// n-best as (tokens, timesteps, score)
+typedef vector<tuple<vector<int>, vector<int>, float>> Candidates;
+
+Candidates to_candidates(vector<Output>& results)
+{
+    Candidates candidates;
+    candidates.reserve(results.size());
+    for (auto& result : results)
+        candidates.emplace_back(move(result.tokens), move(result.timesteps), result.score);
+    return candidates;
+}
+
+// segments ended by an endpoint as (begin_frame, end_frame, candidates)
+typedef vector<tuple<size_t, size_t, Candidates>> Segments;
+
+Segments to_segments(vector<StreamSegment>& stream_segments)
+{
+    Segments segments;
+    segments.reserve(stream_segments.size());
+    for (auto& segment : stream_segments)
+        segments.emplace_back(segment.begin_frame, segment.end_frame, to_candidates(segment.outputs));
+    return segments;
+}
+
+/* Beam search of one utterance fed chunk by chunk, for streaming recognition.
+ * The beam is kept between calls, so every frame is only expanded once. Calls
+ * from several python threads are serialized.
+ */
+class StreamingDecoder
+{
+    StreamDecoder decoder;
+    mutex state_mutex;
+
+public:
+    StreamingDecoder(const DecoderOptions& options)
+        : decoder(options)
+    {}
+
+    StreamingDecoder(const string& snapshot)
+        : decoder(snapshot)
+    {}
+
+    // decode the next frames, returning the segments they end
+    Segments next(py::array_t<float> log_probs)
+    {
+        LogProbsView chunk = chunk_view(log_probs);
+
+        vector<StreamSegment> segments;
+        {
+            // the decoder only reads the chunk during the call and log_probs keeps it alive meanwhile
+            py::gil_scoped_release release;
+            lock_guard<mutex> lock(state_mutex);
+            decoder.next(chunk, segments);
+        }
+        return to_segments(segments);
+    }
+
+    // n-best of the current segment, or its num_results best candidates if not 0, the stream can go on afterwards
+    Candidates decode(bool uncommitted_only, size_t num_results)
+    {
+        vector<Output> results;
+        {
+            py::gil_scoped_release release;
+            lock_guard<mutex> lock(state_mutex);
+            if (num_results > 0)
+                results = decoder.decode_best(num_results, uncommitted_only);
+            else
+                results = uncommitted_only ? decoder.decode_uncommitted() : decoder.decode();
+        }
+        return to_candidates(results);
+    }
+
+    // (tokens, timesteps) committed since the last call
+    pair<vector<int>, vector<int>> pop_committed()
+    {
+        py::gil_scoped_release release;
+        lock_guard<mutex> lock(state_mutex);
+        pair<vector<int>, vector<int>> committed;
+        decoder.pop_committed(committed.first, committed.second);
+        return committed;
+    }
+
+    // forget the frames seen so far and start a new utterance
+    void reset()
+    {
+        py::gil_scoped_release release;
+        lock_guard<mutex> lock(state_mutex);
+        decoder.reset();
+    }
+
+    // candidates of decode() as a lattice
+    py::tuple decode_lattice()
+    {
+        Lattice lattice;
+        {
+            py::gil_scoped_release release;
+            lock_guard<mutex> lock(state_mutex);
+            lattice = decoder.decode_lattice();
+        }
+        return to_lattice(lattice);
+    }
+
+    // binary copy of the decoder, which restore turns back into one
+    py::bytes snapshot()
+    {
+        string data;
+        {
+            py::gil_scoped_release release;
+            lock_guard<mutex> lock(state_mutex);
+            data = decoder.snapshot();
+        }
+        return py::bytes(data);
+    }
+
+    static unique_ptr<StreamingDecoder> restore(const py::bytes& snapshot)
+    {
+        string data = snapshot;
+        py::gil_scoped_release release;
+        return unique_ptr<StreamingDecoder>(new StreamingDecoder(data));
+    }
+
+    size_t get_num_frames()
+    {
+        py::gil_scoped_release release;
+        lock_guard<mutex> lock(state_mutex);
+        return decoder.get_num_frames();
+    }
+
+    size_t get_segment_begin()
+    {
+        py::gil_scoped_release release;
+        lock_guard<mutex> lock(state_mutex);
+        return decoder.get_segment_begin();
+    }
+};
+
+// results of a stream as (stream_id, num_frames, final, candidates, error, segments)
+typedef tuple<int64_t, size_t, bool, Candidates, string, Segments> StreamUpdate;
+
+vector<StreamUpdate> poll_streams(StreamManager& manager, double timeout)
+{
+    vector<StreamResult> results;
+    {
+        py::gil_scoped_release release;
+        results = manager.poll(timeout);
+    }
+
+    vector<StreamUpdate> updates;
+    updates.reserve(results.size());
+    for (auto& result : results)
+    {
+        updates.emplace_back(
+            result.stream_id,
+            result.num_frames,
+            result.final,
+            to_candidates(result.outputs),
+            move(result.error),
+            to_segments(result.segments));
+    }
+    return updates;
+}
+
 PYBIND11_MODULE(ctc_decode, m)
 {
     using namespace pybind11::literals;
 
+    py::enum_<BeamEngine>(m, "BeamEngine").value("trie", BeamEngine::trie).value("hashed", BeamEngine::hashed);
+    py::enum_<MergeMode>(m, "MergeMode")
+        .value("exact", MergeMode::exact)
+        .value("fast", MergeMode::fast)
+        .value("max", MergeMode::max);
+
+    // held as shared_ptr<const Lexicon> in C++, const isn't a thing in python
+    py::class_<Lexicon, shared_ptr<Lexicon>>(m, "Lexicon")
+        .def(
+            py::init([](const string& path) { return const_pointer_cast<Lexicon>(Lexicon::load(path)); }),
+            "load an arc-sorted ConstFst, shared with the decoders already using it",
+            "path"_a,
+            py::call_guard<py::gil_scoped_release>())
+        .def_property_readonly("path", &Lexicon::get_path);
+
+    // held as shared_ptr<const LanguageModel> in C++, like Lexicon
+    py::class_<LanguageModel, shared_ptr<LanguageModel>>(m, "LanguageModel")
+        .def(
+            py::init([](const string& path, const vector<string>& labels, int separator_id) {
+                return const_pointer_cast<LanguageModel>(LanguageModel::load(path, labels, separator_id));
+            }),
+            "load an ARPA or binary n-gram model over the labels, shared with the decoders already using it",
+            "path"_a,
+            "labels"_a,
+            "separator_id"_a = -1,
+            py::call_guard<py::gil_scoped_release>())
+        .def_property_readonly("path", [](const LanguageModel& language_model) {
+            return language_model.get_ngrams().get_path();
+        })
+        .def_property_readonly("order", [](const LanguageModel& language_model) {
+            return language_model.get_ngrams().get_order();
+        });
+    m.def(
+        "convert_language_model",
+        [](const string& arpa_path, const string& binary_path) { NGramModel::load(arpa_path)->save(binary_path); },
+        "write an n-gram model in the binary format",
+        "arpa_path"_a,
+        "binary_path"_a,
+        py::call_guard<py::gil_scoped_release>());
+
+    py::class_<DecoderOptions>(m, "DecoderOptions")
+        .def(py::init<>())
+        .def_readwrite("beam_size", &DecoderOptions::beam_size)
+        .def_readwrite("cutoff_prob", &DecoderOptions::cutoff_prob)
+        .def_readwrite("cutoff_top_n", &DecoderOptions::cutoff_top_n)
+        .def_readwrite("blank_id", &DecoderOptions::blank_id)
+        .def_readwrite("engine", &DecoderOptions::engine)
+        .def_readwrite("merge_mode", &DecoderOptions::merge_mode)
+        .def_readwrite("blank_skip_threshold", &DecoderOptions::blank_skip_threshold)
+        .def_readwrite("beam_threshold", &DecoderOptions::beam_threshold)
+        .def_readwrite("num_expansion_threads", &DecoderOptions::num_expansion_threads)
+        .def_readwrite("segment_blank_frames", &DecoderOptions::segment_blank_frames)
+        .def_readwrite("segment_blank_threshold", &DecoderOptions::segment_blank_threshold)
+        .def_readwrite("max_uncommitted_frames", &DecoderOptions::max_uncommitted_frames)
+        .def_readwrite("endpoint_blank_frames", &DecoderOptions::endpoint_blank_frames)
+        .def_readwrite("endpoint_blank_threshold", &DecoderOptions::endpoint_blank_threshold)
+        .def_readwrite("endpoint_score_margin", &DecoderOptions::endpoint_score_margin)
+        .def_property(
+            "lexicon",
+            [](const DecoderOptions& options) { return const_pointer_cast<Lexicon>(options.lexicon); },
+            [](DecoderOptions& options, shared_ptr<Lexicon> lexicon) { options.lexicon = move(lexicon); })
+        .def_property(
+            "language_model",
+            [](const DecoderOptions& options) { return const_pointer_cast<LanguageModel>(options.language_model); },
+            [](DecoderOptions& options, shared_ptr<LanguageModel> language_model) {
+                options.language_model = move(language_model);
+            })
+        .def_readwrite("lm_alpha", &DecoderOptions::lm_alpha)
+        .def_readwrite("lm_beta", &DecoderOptions::lm_beta);
+
+    m.def("beam_decode", &beam_decode, "beam_decode", "log_probs"_a, "seq_lens"_a, "num_processes"_a, "options"_a);
+    m.def(
+        "beam_decode_packed",
+        &beam_decode_packed,
+        "beam_decode with the n-best packed into numpy arrays",
+        "log_probs"_a,
+        "seq_lens"_a,
+        "num_processes"_a,
+        "options"_a);
     m.def(
-        "beam_decode",
-        &beam_decode,
-        "beam_decode",
+        "beam_decode_lattice",
+        &beam_decode_lattice,
+        "beam_decode with the n-best of every utterance as a lattice",
         "log_probs"_a,
         "seq_lens"_a,
-        "beam_size"_a,
         "num_processes"_a,
-        "cutoff_prob"_a,
-        "cutoff_top_n"_a,
-        "blank_id"_a);
+        "options"_a);
+
+    py::class_<StreamingDecoder>(m, "StreamingDecoder")
+        .def(py::init<const DecoderOptions&>(), "options"_a)
+        .def("next", &StreamingDecoder::next, "decode the next chunk of frames", "log_probs"_a)
+        .def(
+            "decode",
+            &StreamingDecoder::decode,
+            "n-best of the current segment",
+            "uncommitted_only"_a,
+            "num_results"_a)
+        .def("decode_lattice", &StreamingDecoder::decode_lattice, "n-best of the current segment as a lattice")
+        .def("pop_committed", &StreamingDecoder::pop_committed, "tokens committed since the last call")
+        .def("reset", &StreamingDecoder::reset, "start a new utterance")
+        .def("snapshot", &StreamingDecoder::snapshot, "binary copy of the decoder")
+        .def_static("restore", &StreamingDecoder::restore, "decoder from a snapshot", "snapshot"_a)
+        .def_property_readonly("num_frames", &StreamingDecoder::get_num_frames)
+        .def_property_readonly("segment_begin", &StreamingDecoder::get_segment_begin);
+
+    // results are only delivered through poll, a callback would need the GIL on the scheduler thread
+    py::class_<StreamManager>(m, "StreamManager")
+        .def(
+            py::init<const DecoderOptions&, size_t, size_t, size_t>(),
+            "options"_a,
+            "max_batch_streams"_a,
+            "num_processes"_a,
+            "max_results"_a)
+        .def(
+            "push",
+            [](StreamManager& manager, int64_t stream_id, py::array_t<float> log_probs) {
+                LogProbsView chunk = chunk_view(log_probs);
+                py::gil_scoped_release release;
+                manager.push(stream_id, chunk);
+            },
+            "queue the next chunk of a stream",
+            "stream_id"_a,
+            "log_probs"_a)
+        .def("finish", &StreamManager::finish, "end a stream", "stream_id"_a, py::call_guard<py::gil_scoped_release>())
+        .def("poll", &poll_streams, "results updated since the last poll", "timeout"_a)
+        .def("flush", &StreamManager::flush, "wait for the queued chunks", py::call_guard<py::gil_scoped_release>())
+        .def(
+            "snapshot",
+            [](StreamManager& manager, int64_t stream_id) {
+                string data;
+                {
+                    py::gil_scoped_release release;
+                    data = manager.snapshot(stream_id);
+                }
+                return py::bytes(data);
+            },
+            "binary copy of a stream once its queued chunks are decoded",
+            "stream_id"_a)
+        .def(
+            "restore",
+            [](StreamManager& manager, int64_t stream_id, const py::bytes& snapshot) {
+                string data = snapshot;
+                py::gil_scoped_release release;
+                manager.restore(stream_id, data);
+            },
+            "start a stream from a snapshot",
+            "stream_id"_a,
+            "snapshot"_a)
+        .def_property_readonly("num_streams", &StreamManager::num_streams);
+
+    m.def(
+        "set_num_threads",
+        &set_num_threads,
+        "set the number of workers of the thread pool shared by all decoders, before the first decode",
+        "num_threads"_a);
+    m.def("get_num_threads", &get_num_threads, "number of workers of the shared thread pool");
 }
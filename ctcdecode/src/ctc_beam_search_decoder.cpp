@@ -5,160 +5,793 @@
 #include <iostream>
 #include <limits>
 #include <map>
+#include <mutex>
+#include <queue>
+#include <set>
+#include <stdexcept>
+#include <unordered_map>
 #include <utility>
 
 #include "decoder_utils.h"
 #include "fst/fstlib.h"
 #include "output.h"
 #include "path_trie.h"
-#include "thread_pool.h"
+#include "snapshot.h"
 using namespace std;
 
-DecoderState::DecoderState(size_t beam_size, float cutoff_prob, size_t cutoff_top_n, size_t blank_id)
+namespace
+{
+// fewest prefix and character pairs worth expanding on a thread of its own
+const size_t MIN_EXPANSIONS_PER_THREAD = 2048;
+
+mutex thread_pool_mutex;
+size_t thread_pool_size = 0;
+thread_pool* shared_thread_pool = nullptr;
+
+size_t default_num_threads()
+{
+    return max<size_t>(thread::hardware_concurrency(), 1);
+}
+}
+
+thread_pool& get_thread_pool()
+{
+    lock_guard<mutex> lock(thread_pool_mutex);
+    if (shared_thread_pool == nullptr)
+    {
+        // never deleted: the workers sleep while idle, and joining them from static destructors at exit is fragile
+        shared_thread_pool = new thread_pool(thread_pool_size > 0 ? thread_pool_size : default_num_threads());
+    }
+    return *shared_thread_pool;
+}
+
+void set_num_threads(size_t num_threads)
+{
+    lock_guard<mutex> lock(thread_pool_mutex);
+    size_t requested = num_threads > 0 ? num_threads : default_num_threads();
+    if (shared_thread_pool != nullptr)
+    {
+        if (shared_thread_pool->num_threads() != requested)
+            throw runtime_error("the number of threads can only be set before the first decode");
+        return;
+    }
+    thread_pool_size = requested;
+}
+
+size_t get_num_threads()
+{
+    lock_guard<mutex> lock(thread_pool_mutex);
+    if (shared_thread_pool != nullptr)
+        return shared_thread_pool->num_threads();
+    return thread_pool_size > 0 ? thread_pool_size : default_num_threads();
+}
+
+DecoderWorkspace& DecoderWorkspace::for_this_thread()
+{
+    // a worker of the pool always runs on the same thread, so this is a per-worker workspace that also covers
+    // decoders driven from threads outside the pool
+    static thread_local DecoderWorkspace workspace;
+    return workspace;
+}
+
+DecoderState::DecoderState(const DecoderOptions& options, DecoderWorkspace* workspace)
     : abs_time_step(0)
-    , beam_size(beam_size)
-    , cutoff_prob(cutoff_prob)
-    , cutoff_top_n(cutoff_top_n)
-    , blank_id(blank_id)
+    , options(options)
+    , workspace(workspace)
 {
+    if (this->workspace == nullptr || this->workspace->in_use)
+    {
+        own_workspace.reset(new DecoderWorkspace);
+        this->workspace = own_workspace.get();
+    }
+    this->workspace->in_use = true;
+    this->workspace->lexicon.bind(options.lexicon);
+    this->workspace->language_model.bind(options.language_model, options.lm_alpha, options.lm_beta);
+
     // init prefixes' root
-    root.score = root.log_prob_b_prev = 0.0f;
-    prefixes.push_back(&root);
+    root = this->workspace->nodes.acquire();
+    root->score = root->log_prob_b_prev = 0.0f;
+    if (options.lexicon != nullptr)
+        root->set_lexicon(this->workspace->lexicon);
+    if (options.language_model != nullptr)
+        root->set_language_model(this->workspace->language_model);
+    best_prefix = root;
+    this->workspace->prefixes.clear();
+    this->workspace->prefixes.push_back(root);
+}
+
+DecoderState::DecoderState(const string& snapshot, DecoderWorkspace* workspace)
+    : DecoderState(read_snapshot_options(snapshot, SnapshotKind::trie_state), workspace)
+{
+    // delegating, so that the destructor hands the workspace back if the snapshot turns out to be corrupt
+    SnapshotReader reader(snapshot);
+    read_snapshot_header(reader, SnapshotKind::trie_state);
+    abs_time_step = reader.read<int32_t>();
+    reader.read_vector(committed_tokens);
+    reader.read_vector(committed_timesteps);
+
+    vector<PathTrie*> nodes;
+    this->workspace->nodes.clear();
+    PathTrie::load(reader, this->workspace->nodes, nodes, options.lexicon.get(), options.language_model.get());
+    root = nodes[0];
+
+    vector<uint32_t> prefixes;
+    reader.read_vector(prefixes);
+    if (!PathTrie::is_valid_beam(nodes, prefixes))
+        throw invalid_argument("corrupt decoder snapshot");
+    this->workspace->prefixes.clear();
+    for (uint32_t prefix : prefixes)
+    {
+        this->workspace->prefixes.push_back(nodes[prefix]);
+    }
+    if (prefixes.empty() || committed_tokens.size() != committed_timesteps.size() || !reader.at_end())
+        throw invalid_argument("corrupt decoder snapshot");
+    best_prefix = *min_element(this->workspace->prefixes.begin(), this->workspace->prefixes.end(), prefix_compare);
+}
+
+DecoderState::~DecoderState()
+{
+    // free the whole trie at once, its blocks are reused for the next utterance decoded with this workspace
+    workspace->nodes.clear();
+    for (auto& partition : workspace->partitions)
+    {
+        partition->nodes.clear();
+        partition->lexicon.bind(nullptr);
+        partition->language_model.bind(nullptr, 0.0f, 0.0f);
+    }
+    workspace->prefixes.clear();
+    // matchers and scorers are cheap to make again, the lexicon and the model shouldn't outlive their decoders
+    // because of one
+    workspace->lexicon.bind(nullptr);
+    workspace->language_model.bind(nullptr, 0.0f, 0.0f);
+    workspace->in_use = false;
+}
+
+void DecoderState::next(const LogProbsView& probs_seq)
+{
+    // prune a block of frames at once, then expand them
+    for (size_t begin = 0; begin < probs_seq.size(); begin += PRUNE_BLOCK_SIZE)
+    {
+        size_t end = min(begin + PRUNE_BLOCK_SIZE, probs_seq.size());
+        prune_log_probs(probs_seq, begin, end, options, workspace->pruned);
+        next(workspace->pruned);
+    }
+}
+
+void DecoderState::next(const PrunedLogProbs& pruned)
+{
+    switch (options.merge_mode)
+    {
+    case MergeMode::exact:
+        expand(pruned, ExactLogAdd());
+        break;
+    case MergeMode::fast:
+        expand(pruned, FastLogAdd());
+        break;
+    case MergeMode::max:
+        expand(pruned, MaxLogAdd());
+        break;
+    }
+
+    // re-root the trie below the prefix the whole beam agrees on, which keeps every prefix of the beam
+    best_prefix = *min_element(workspace->prefixes.begin(), workspace->prefixes.end(), prefix_compare);
+    drop_stale_prefixes();
+    root = root->commit_stable_prefix(workspace->nodes, committed_tokens, committed_timesteps);
+}
+
+void DecoderState::drop_stale_prefixes()
+{
+    if (options.max_uncommitted_frames == 0)
+        return;
+
+    // deepest node of the best prefix that is old enough to be committed
+    auto& prefixes = workspace->prefixes;
+    const int horizon = abs_time_step - static_cast<int>(options.max_uncommitted_frames);
+    PathTrie* anchor = best_prefix;
+    while (anchor->parent != nullptr && anchor->timestep > horizon)
+    {
+        anchor = anchor->parent;
+    }
+    if (anchor->parent == nullptr)
+        return;
+
+    size_t num_kept = 0;
+    for (size_t i = 0; i < prefixes.size(); ++i)
+    {
+        PathTrie* node = prefixes[i];
+        while (node != anchor && node->parent != nullptr)
+        {
+            node = node->parent;
+        }
+        if (node == anchor)
+        {
+            prefixes[num_kept++] = prefixes[i];
+        }
+        else
+        {
+            prefixes[i]->remove(workspace->nodes);
+        }
+    }
+    prefixes.resize(num_kept);
 }
 
-void DecoderState::next(const vector<vector<float>>& probs_seq)
+template <typename LogAdd>
+void DecoderState::expand(const PrunedLogProbs& pruned, LogAdd log_add)
 {
-    // dimension check
-    size_t num_time_steps = probs_seq.size();
+    auto& prefixes = workspace->prefixes;
+    auto& activated = workspace->activated;
 
     // prefix search over time
-    for (size_t time_step = 0; time_step < num_time_steps; ++time_step, ++abs_time_step)
+    for (size_t time_step = 0; time_step < pruned.num_frames(); ++time_step, ++abs_time_step)
     {
-        auto& prob = probs_seq[time_step];
+        float blank_log_prob;
+        size_t blank_run = pruned.blank_run(time_step, blank_log_prob);
+        if (blank_run > 0)
+        {
+            // nothing but blank: every prefix ends in blank afterwards, and all their scores move by the same amount
+            for (auto prefix : prefixes)
+            {
+                prefix->log_prob_b_prev = prefix->score + blank_log_prob;
+                prefix->log_prob_nb_prev = -NUM_FLT_INF;
+                prefix->score = prefix->log_prob_b_prev;
+            }
+            // the loop steps over the last frame of the run
+            time_step += blank_run - 1;
+            abs_time_step += blank_run - 1;
+            continue;
+        }
+
+        // extensions scoring more than beam_threshold below the best one this frame can reach are not made, -inf
+        // without a threshold
+        float best_score = -NUM_FLT_INF;
+        for (auto prefix : prefixes)
+        {
+            best_score = max(best_score, prefix->score);
+        }
+        const float min_cutoff = best_score + pruned.max_log_prob(time_step) - options.beam_threshold;
 
-        float min_cutoff = -NUM_FLT_INF;
-        bool full_beam = false;
+        // frames with few expansions aren't worth the synchronization
+        const size_t num_prefixes = min(prefixes.size(), options.beam_size);
+        const size_t num_chars = pruned.offsets[time_step + 1] - pruned.offsets[time_step];
+        const size_t num_partitions
+            = min(options.num_expansion_threads, num_prefixes * num_chars / MIN_EXPANSIONS_PER_THREAD);
+        activated.clear();
+        if (num_partitions >= 2)
+        {
+            expand_prefixes_in_parallel(
+                pruned, time_step, num_prefixes, best_score, min_cutoff, num_partitions, log_add);
+        }
+        else
+        {
+            expand_prefixes(pruned, time_step, 0, num_prefixes, best_score, min_cutoff, nullptr, log_add);
+        }
 
-        vector<pair<size_t, float>> log_prob_idx = get_pruned_log_probs(prob, cutoff_prob, cutoff_top_n);
-        // loop over chars
-        for (size_t index = 0; index < log_prob_idx.size(); index++)
+        // the only live nodes are the current prefixes and the ones their extensions just activated, so there is
+        // no need to walk the whole trie to find them
+        prefixes.insert(prefixes.end(), activated.begin(), activated.end());
+        // update log probs
+        for (auto prefix : prefixes)
         {
-            auto c = log_prob_idx[index].first;
-            auto log_prob_c = log_prob_idx[index].second;
+            prefix->update_log_probs(log_add);
+        }
 
-            for (size_t i = 0; i < prefixes.size() && i < beam_size; ++i)
+        // drop the prefixes that fell more than beam_threshold behind the best one, keeping the others in order.
+        // The best one always stays, the beam can't be empty.
+        best_score = -NUM_FLT_INF;
+        size_t best = 0;
+        for (size_t i = 0; i < prefixes.size(); ++i)
+        {
+            if (prefixes[i]->score > best_score)
+            {
+                best_score = prefixes[i]->score;
+                best = i;
+            }
+        }
+        size_t num_kept = 0;
+        for (size_t i = 0; i < prefixes.size(); ++i)
+        {
+            if (i != best && prefixes[i]->score < best_score - options.beam_threshold)
             {
-                auto prefix = prefixes[i];
-                if (full_beam && log_prob_c + prefix->score < min_cutoff)
+                prefixes[i]->remove(workspace->nodes);
+            }
+            else
+            {
+                prefixes[num_kept++] = prefixes[i];
+            }
+        }
+        prefixes.resize(num_kept);
+
+        // only preserve top beam_size prefixes
+        if (prefixes.size() >= options.beam_size)
+        {
+            nth_element(prefixes.begin(), prefixes.begin() + options.beam_size, prefixes.end(), prefix_compare);
+            for (size_t i = options.beam_size; i < prefixes.size(); ++i)
+            {
+                prefixes[i]->remove(workspace->nodes);
+            }
+
+            prefixes.resize(options.beam_size);
+        }
+    }  // end of loop over time
+}
+
+template <typename LogAdd>
+void DecoderState::expand_prefixes(
+    const PrunedLogProbs& pruned,
+    size_t time_step,
+    size_t begin,
+    size_t end,
+    float best_score,
+    float min_cutoff,
+    ExpansionPartition* partition,
+    LogAdd log_add)
+{
+    auto& prefixes = workspace->prefixes;
+    auto& nodes = partition != nullptr ? partition->nodes : workspace->nodes;
+    auto& activated = partition != nullptr ? partition->activated : workspace->activated;
+    LexiconMatcher* lexicon = nullptr;
+    if (options.lexicon != nullptr)
+        lexicon = partition != nullptr ? &partition->lexicon : &workspace->lexicon;
+    LanguageModelScorer* language_model = nullptr;
+    if (options.language_model != nullptr)
+        language_model = partition != nullptr ? &partition->language_model : &workspace->language_model;
+
+    // loop over chars
+    for (size_t index = pruned.offsets[time_step]; index < pruned.offsets[time_step + 1]; index++)
+    {
+        size_t c = pruned.indices[index];
+        float log_prob_c = pruned.log_probs[index];
+        if (log_prob_c + best_score < min_cutoff)
+        {
+            continue;
+        }
+
+        for (size_t i = begin; i < end; ++i)
+        {
+            auto prefix = prefixes[i];
+            if (log_prob_c + prefix->score < min_cutoff)
+            {
+                continue;
+            }
+            // blank
+            if (c == options.blank_id)
+            {
+                prefix->log_prob_b_cur = log_add(prefix->log_prob_b_cur, log_prob_c + prefix->score);
+                continue;
+            }
+            // repeated character
+            if (c == prefix->character)
+            {
+                prefix->log_prob_nb_cur = log_add(prefix->log_prob_nb_cur, log_prob_c + prefix->log_prob_nb_prev);
+            }
+            // get new prefix
+            size_t num_activated = activated.size();
+            auto prefix_new
+                = prefix->get_path_trie(c, abs_time_step, log_prob_c, nodes, activated, lexicon, language_model);
+            bool is_new = activated.size() > num_activated;
+            if (partition != nullptr && is_new)
+            {
+                partition->activated_chars.push_back(index);
+            }
+
+            if (prefix_new != nullptr)
+            {
+                float log_p = -NUM_FLT_INF;
+
+                if (c == prefix->character && prefix->log_prob_b_prev > -NUM_FLT_INF)
                 {
-                    break;
+                    log_p = log_prob_c + prefix->log_prob_b_prev + prefix_new->lm_score;
                 }
-                // blank
-                if (c == blank_id)
+                else if (c != prefix->character)
                 {
-                    prefix->log_prob_b_cur = log_sum_exp(prefix->log_prob_b_cur, log_prob_c + prefix->score);
-                    continue;
+                    log_p = log_prob_c + prefix->score + prefix_new->lm_score;
                 }
-                // repeated character
-                if (c == prefix->character)
+
+                if (partition != nullptr && !is_new)
                 {
-                    prefix->log_prob_nb_cur
-                        = log_sum_exp(prefix->log_prob_nb_cur, log_prob_c + prefix->log_prob_nb_prev);
+                    // prefix_new is in the beam, and its own thread may be adding to it as well. The additions
+                    // commute: there is one from each side at most, and the first one is into -inf.
+                    partition->deferred.emplace_back(prefix_new, log_p);
                 }
-                // get new prefix
-                auto prefix_new = prefix->get_path_trie(c, abs_time_step, log_prob_c);
-
-                if (prefix_new != nullptr)
+                else
                 {
-                    float log_p = -NUM_FLT_INF;
-
-                    if (c == prefix->character && prefix->log_prob_b_prev > -NUM_FLT_INF)
-                    {
-                        log_p = log_prob_c + prefix->log_prob_b_prev;
-                    }
-                    else if (c != prefix->character)
-                    {
-                        log_p = log_prob_c + prefix->score;
-                    }
-
-                    prefix_new->log_prob_nb_cur = log_sum_exp(prefix_new->log_prob_nb_cur, log_p);
+                    prefix_new->log_prob_nb_cur = log_add(prefix_new->log_prob_nb_cur, log_p);
                 }
-            }  // end of loop over prefix
-        }  // end of loop over vocabulary
+            }
+        }  // end of loop over prefix
+    }  // end of loop over vocabulary
+}
 
-        prefixes.clear();
-        // update log probs
-        root.iterate_to_vec(prefixes);
+template <typename LogAdd>
+void DecoderState::expand_prefixes_in_parallel(
+    const PrunedLogProbs& pruned,
+    size_t time_step,
+    size_t num_prefixes,
+    float best_score,
+    float min_cutoff,
+    size_t num_partitions,
+    LogAdd log_add)
+{
+    auto& partitions = workspace->partitions;
+    while (partitions.size() < num_partitions)
+    {
+        partitions.emplace_back(new ExpansionPartition);
+    }
+    for (size_t r = 0; r < num_partitions; ++r)
+    {
+        auto& partition = *partitions[r];
+        partition.activated.clear();
+        partition.activated_chars.clear();
+        partition.deferred.clear();
+        partition.lexicon.bind(options.lexicon);
+        partition.language_model.bind(options.language_model, options.lm_alpha, options.lm_beta);
+        // removed nodes all go back to the workspace's arena, share them out again
+        workspace->nodes.give_free_nodes(partition.nodes, workspace->nodes.num_free() / (num_partitions - r));
+    }
 
-        // only preserve top beam_size prefixes
-        if (prefixes.size() >= beam_size)
+    // every thread expands a contiguous range of prefixes, which only touches the children of its own prefixes
+    get_thread_pool().parallel_for(
+        0,
+        num_partitions,
+        [&](size_t r, size_t) {
+            size_t begin = num_prefixes * r / num_partitions;
+            size_t end = num_prefixes * (r + 1) / num_partitions;
+            expand_prefixes(pruned, time_step, begin, end, best_score, min_cutoff, partitions[r].get(), log_add);
+        },
+        num_partitions);
+
+    for (size_t r = 0; r < num_partitions; ++r)
+    {
+        for (const auto& deferred : partitions[r]->deferred)
         {
-            nth_element(prefixes.begin(), prefixes.begin() + beam_size, prefixes.end(), prefix_compare);
-            for (size_t i = beam_size; i < prefixes.size(); ++i)
+            deferred.first->log_prob_nb_cur = log_add(deferred.first->log_prob_nb_cur, deferred.second);
+        }
+    }
+
+    // activated nodes in the order a single thread creates them, by character and then by prefix, so that the
+    // results don't depend on the number of threads
+    auto& activated = workspace->activated;
+    auto& positions = workspace->partition_positions;
+    positions.assign(num_partitions, 0);
+    for (;;)
+    {
+        size_t next = num_partitions;
+        for (size_t r = 0; r < num_partitions; ++r)
+        {
+            const auto& chars = partitions[r]->activated_chars;
+            if (positions[r] < chars.size()
+                && (next == num_partitions || chars[positions[r]] < partitions[next]->activated_chars[positions[next]]))
             {
-                prefixes[i]->remove();
+                next = r;
             }
-
-            prefixes.resize(beam_size);
         }
-    }  // end of loop over time
+        if (next == num_partitions)
+            break;
+        activated.push_back(partitions[next]->activated[positions[next]++]);
+    }
 }
 
 vector<Output> DecoderState::decode() const
 {
-    vector<PathTrie*> prefixes_copy = prefixes;
-    unordered_map<const PathTrie*, float> scores;
-    for (PathTrie* prefix : prefixes_copy)
+    vector<Output> outputs = decode_uncommitted();
+    if (!committed_tokens.empty())
+    {
+        for (auto& output : outputs)
+        {
+            output.tokens.insert(output.tokens.begin(), committed_tokens.begin(), committed_tokens.end());
+            output.timesteps.insert(output.timesteps.begin(), committed_timesteps.begin(), committed_timesteps.end());
+        }
+    }
+    return outputs;
+}
+
+vector<PathTrie*> DecoderState::sorted_prefixes() const
+{
+    // scores don't change between frames, the prefixes are compared as they are. Sorted twice, as decode() always
+    // has been: sort isn't stable, and the second pass gives ties the order they have always come out in.
+    vector<PathTrie*> prefixes = workspace->prefixes;
+    size_t num_prefixes = min(prefixes.size(), options.beam_size);
+    sort(prefixes.begin(), prefixes.begin() + num_prefixes, prefix_compare);
+    prefixes.resize(num_prefixes);
+    sort(prefixes.begin(), prefixes.end(), prefix_compare);
+    return prefixes;
+}
+
+vector<Output> DecoderState::decode_uncommitted() const
+{
+    const vector<PathTrie*> prefixes = sorted_prefixes();
+    vector<Output> outputs;
+    outputs.reserve(prefixes.size());
+    for (PathTrie* prefix : prefixes)
+    {
+        vector<int> tokens;
+        vector<int> timesteps;
+        prefix->get_path_vec(tokens, timesteps);
+        outputs.emplace_back(-prefix->score, tokens, timesteps);
+    }
+    return outputs;
+}
+
+vector<Output> DecoderState::decode_best(size_t num_results, bool uncommitted_only) const
+{
+    vector<PathTrie*> best;
+    if (num_results == 1)
+        best.push_back(best_prefix);
+    else
+    {
+        best = workspace->prefixes;
+        num_results = min(num_results, best.size());
+        partial_sort(best.begin(), best.begin() + num_results, best.end(), prefix_compare);
+        best.resize(num_results);
+    }
+
+    vector<Output> outputs;
+    outputs.reserve(best.size());
+    for (PathTrie* prefix : best)
+    {
+        vector<int> tokens;
+        vector<int> timesteps;
+        prefix->get_path_vec(tokens, timesteps);
+        if (!uncommitted_only)
+        {
+            tokens.insert(tokens.begin(), committed_tokens.begin(), committed_tokens.end());
+            timesteps.insert(timesteps.begin(), committed_timesteps.begin(), committed_timesteps.end());
+        }
+        outputs.emplace_back(-prefix->score, tokens, timesteps);
+    }
+    return outputs;
+}
+
+Lattice DecoderState::decode_lattice() const
+{
+    // the candidates of decode(), in the same order
+    const vector<PathTrie*> candidates = sorted_prefixes();
+
+    Lattice lattice;
+    const float best_log_prob = candidates.empty() ? -NUM_FLT_INF : candidates[0]->score;
+    int trunk = -1;
+    for (size_t i = 0; i < committed_tokens.size(); ++i)
+    {
+        trunk = lattice.add_node(committed_tokens[i], committed_timesteps[i], trunk, best_log_prob);
+    }
+
+    // best first, so that a node gets the log probability of the first candidate going through it
+    unordered_map<const PathTrie*, int> nodes;
+    nodes[root] = trunk;
+    vector<PathTrie*> path;
+    for (PathTrie* candidate : candidates)
+    {
+        path.clear();
+        PathTrie* node = candidate;
+        auto known = nodes.find(node);
+        while (known == nodes.end())
+        {
+            path.push_back(node);
+            node = node->parent;
+            known = nodes.find(node);
+        }
+
+        int parent = known->second;
+        for (auto it = path.rbegin(); it != path.rend(); ++it)
+        {
+            parent = lattice.add_node((*it)->character, (*it)->timestep, parent, candidate->score);
+            nodes[*it] = parent;
+        }
+        lattice.candidates.push_back(parent);
+        lattice.candidate_log_probs.push_back(candidate->score);
+    }
+    return lattice;
+}
+
+string DecoderState::snapshot() const
+{
+    SnapshotWriter writer;
+    write_snapshot_header(writer, SnapshotKind::trie_state, options);
+    writer.write<int32_t>(abs_time_step);
+    writer.write_vector(committed_tokens);
+    writer.write_vector(committed_timesteps);
+
+    // every prefix of the beam descends from the root
+    unordered_map<const PathTrie*, uint32_t> numbers;
+    root->save(writer, numbers);
+    vector<uint32_t> prefixes;
+    prefixes.reserve(workspace->prefixes.size());
+    for (PathTrie* prefix : workspace->prefixes)
     {
-        scores[prefix] = prefix->score;
+        prefixes.push_back(numbers.at(prefix));
     }
+    writer.write_vector(prefixes);
+    return writer.release();
+}
 
-    using namespace placeholders;
-    size_t num_prefixes = min(prefixes_copy.size(), beam_size);
-    sort(
-        prefixes_copy.begin(),
-        prefixes_copy.begin() + num_prefixes,
-        bind(prefix_compare_external_scores, _1, _2, scores));
+namespace
+{
+// frames at which to cut probs_seq: the middle of every run of confident blanks that is long enough, apart from
+// runs at either end
+vector<size_t> find_segment_cuts(const LogProbsView& probs_seq, const DecoderOptions& options)
+{
+    vector<size_t> cuts;
+    if (options.blank_id >= probs_seq.num_classes)
+        return cuts;
 
-    // compute aproximate ctc score as the return score, without affecting the
-    // return order of decoding result. To delete when decoder gets stable.
-    for (size_t i = 0; i < beam_size && i < prefixes_copy.size(); ++i)
+    const float log_threshold = log(options.segment_blank_threshold);
+    size_t run_begin = 0;
+    size_t run_length = 0;
+    for (size_t t = 0; t < probs_seq.size(); ++t)
     {
-        float approx_ctc = scores[prefixes_copy[i]];
-        prefixes_copy[i]->approx_ctc = approx_ctc;
+        if (probs_seq(t, options.blank_id) >= log_threshold)
+        {
+            if (run_length++ == 0)
+                run_begin = t;
+            continue;
+        }
+        if (run_length >= options.segment_blank_frames && run_begin > 0)
+            cuts.push_back(run_begin + run_length / 2);
+        run_length = 0;
+    }
+    return cuts;
+}
+
+// The beam_size best concatenations of an output of head with one of tail, both sorted by increasing score.
+// Concatenations with the same tokens are merged like prefixes of the beam are.
+vector<Output> join_outputs(const vector<Output>& head, const vector<Output>& tail, const DecoderOptions& options)
+{
+    vector<Output> joined;
+    if (head.empty() || tail.empty())
+        return joined;
+
+    // best-first walk over the pairs of outputs, ties broken by their indices
+    typedef pair<float, pair<size_t, size_t>> item;
+    priority_queue<item, vector<item>, greater<item>> frontier;
+    set<pair<size_t, size_t>> visited;
+    map<vector<int>, size_t> index_of;
+    frontier.push({ head[0].score + tail[0].score, { 0, 0 } });
+    visited.insert({ 0, 0 });
+    while (!frontier.empty() && joined.size() < options.beam_size)
+    {
+        float score = frontier.top().first;
+        size_t i = frontier.top().second.first;
+        size_t j = frontier.top().second.second;
+        frontier.pop();
+
+        vector<int> tokens = head[i].tokens;
+        tokens.insert(tokens.end(), tail[j].tokens.begin(), tail[j].tokens.end());
+        auto found = index_of.find(tokens);
+        if (found != index_of.end())
+        {
+            // scores are negative log probabilities
+            float& merged = joined[found->second].score;
+            merged = options.merge_mode == MergeMode::max ? min(merged, score) : -log_sum_exp(-merged, -score);
+        }
+        else
+        {
+            vector<int> timesteps = head[i].timesteps;
+            timesteps.insert(timesteps.end(), tail[j].timesteps.begin(), tail[j].timesteps.end());
+            index_of.emplace(tokens, joined.size());
+            joined.emplace_back(score, tokens, timesteps);
+        }
+
+        if (i + 1 < head.size() && visited.insert({ i + 1, j }).second)
+            frontier.push({ head[i + 1].score + tail[j].score, { i + 1, j } });
+        if (j + 1 < tail.size() && visited.insert({ i, j + 1 }).second)
+            frontier.push({ head[i].score + tail[j + 1].score, { i, j + 1 } });
     }
 
-    return get_beam_search_result(prefixes_copy, beam_size);
+    stable_sort(joined.begin(), joined.end(), [](const Output& x, const Output& y) { return x.score < y.score; });
+    return joined;
 }
 
-vector<Output> ctc_beam_search_decoder(
-    const vector<vector<float>>& probs_seq, int beam_size, float cutoff_prob, size_t cutoff_top_n, size_t blank_id)
+// decode the segments between cuts concurrently and join their results
+vector<Output> decode_segments(const LogProbsView& probs_seq, const vector<size_t>& cuts, const DecoderOptions& options)
 {
-    DecoderState state(beam_size, cutoff_prob, cutoff_top_n, blank_id);
+    vector<size_t> bounds(1, 0);
+    bounds.insert(bounds.end(), cuts.begin(), cuts.end());
+    bounds.push_back(probs_seq.size());
+    const size_t num_segments = bounds.size() - 1;
+
+    DecoderOptions segment_options = options;
+    segment_options.segment_blank_frames = 0;
+    vector<vector<Output>> segment_outputs(num_segments);
+    get_thread_pool().parallel_for(
+        0,
+        num_segments,
+        [&](size_t i, size_t) {
+            segment_outputs[i] = ctc_beam_search_decoder(probs_seq.frames(bounds[i], bounds[i + 1]), segment_options);
+            for (auto& output : segment_outputs[i])
+            {
+                for (auto& timestep : output.timesteps)
+                {
+                    timestep += static_cast<int>(bounds[i]);
+                }
+            }
+        },
+        numeric_limits<size_t>::max(),
+        [&](size_t i) { return bounds[i + 1] - bounds[i]; });
+
+    vector<Output> outputs = move(segment_outputs[0]);
+    for (size_t i = 1; i < num_segments; ++i)
+    {
+        outputs = join_outputs(outputs, segment_outputs[i], options);
+    }
+    return outputs;
+}
+}
+
+vector<Output> ctc_beam_search_decoder(const LogProbsView& probs_seq, const DecoderOptions& options)
+{
+    // the lexicon and the language model state of a prefix would start over at every cut
+    if (options.segment_blank_frames > 0 && options.lexicon == nullptr && options.language_model == nullptr)
+    {
+        vector<size_t> cuts = find_segment_cuts(probs_seq, options);
+        if (!cuts.empty())
+        {
+            return decode_segments(probs_seq, cuts, options);
+        }
+    }
+
+    if (options.engine == BeamEngine::hashed)
+    {
+        HashedDecoderState state(options, &DecoderWorkspace::for_this_thread());
+        state.next(probs_seq);
+        return state.decode();
+    }
+
+    DecoderState state(options, &DecoderWorkspace::for_this_thread());
     state.next(probs_seq);
     return state.decode();
 }
 
-vector<vector<Output>> ctc_beam_search_decoder_batch(
-    const vector<vector<vector<float>>>& probs_split,
-    int beam_size,
-    size_t num_processes,
-    float cutoff_prob,
-    size_t cutoff_top_n,
-    size_t blank_id)
+namespace
+{
+// result of decode_sample for every sample, decoded on the shared thread pool
+template <typename Result, typename DecodeSample>
+vector<Result> decode_batch(const vector<LogProbsView>& probs_split, size_t num_processes, DecodeSample decode_sample)
 {
     VALID_CHECK_GT(num_processes, 0, "num_processes must be nonnegative!");
-    // thread pool
-    thread_pool pool(num_processes);
+    thread_pool& pool = get_thread_pool();
     // number of samples
     size_t batch_size = probs_split.size();
 
-    // enqueue the tasks of decoding
-    vector<vector<Output>> outputs(batch_size);
+    vector<Result> outputs(batch_size);
 
-    pool.parallel_for(0, batch_size, [&](size_t i, size_t) {
-        outputs[i] = ctc_beam_search_decoder(probs_split[i], beam_size, cutoff_prob, cutoff_top_n, blank_id);
-    });
+    pool.parallel_for(
+        0,
+        batch_size,
+        [&](size_t i, size_t) { outputs[i] = decode_sample(probs_split[i]); },
+        num_processes,
+        // decoding time is roughly linear in the number of frames, start the longest utterances first
+        [&](size_t i) { return probs_split[i].num_time_steps; });
 
     return outputs;
 }
+
+Lattice ctc_beam_search_lattice(const LogProbsView& probs_seq, const DecoderOptions& options)
+{
+    if (options.engine == BeamEngine::hashed)
+    {
+        HashedDecoderState state(options, &DecoderWorkspace::for_this_thread());
+        state.next(probs_seq);
+        return state.decode_lattice();
+    }
+
+    DecoderState state(options, &DecoderWorkspace::for_this_thread());
+    state.next(probs_seq);
+    return state.decode_lattice();
+}
+}
+
+vector<vector<Output>> ctc_beam_search_decoder_batch(
+    const vector<LogProbsView>& probs_split, size_t num_processes, const DecoderOptions& options)
+{
+    return decode_batch<vector<Output>>(probs_split, num_processes, [&](const LogProbsView& probs_seq) {
+        return ctc_beam_search_decoder(probs_seq, options);
+    });
+}
+
+vector<Lattice> ctc_beam_search_lattice_batch(
+    const vector<LogProbsView>& probs_split, size_t num_processes, const DecoderOptions& options)
+{
+    return decode_batch<Lattice>(probs_split, num_processes, [&](const LogProbsView& probs_seq) {
+        return ctc_beam_search_lattice(probs_seq, options);
+    });
+}
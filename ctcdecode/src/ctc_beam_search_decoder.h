@@ -1,82 +1,182 @@
 #pragma once
 
+#include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "decoder_options.h"
+#include "decoder_utils.h"
+#include "hashed_beam_search.h"
+#include "language_model.h"
+#include "lexicon.h"
+#include "log_probs_view.h"
 #include "output.h"
 #include "path_trie.h"
+#include "thread_pool.h"
 
 /* CTC Beam Search Decoder
 
  * Parameters:
- *     probs_seq: 2-D vector that each element is a vector of probabilities
+ *     probs_seq: 2-D view of log probabilities, each row is the distribution
  *               over vocabulary of one time step.
- *     beam_size: The width of beam search.
- *     cutoff_prob: Cutoff probability for pruning.
- *     cutoff_top_n: Cutoff number for pruning.
+ *     options: Settings of the beam search.
  * Return:
  *     A vector that each element is a pair of score  and decoding result,
  *     in desending order.
 */
 
-std::vector<Output> ctc_beam_search_decoder(
-    const std::vector<std::vector<float>>& probs_seq,
-    int beam_size,
-    float cutoff_prob = 1.0,
-    size_t cutoff_top_n = 40,
-    size_t blank_id = 0);
+std::vector<Output> ctc_beam_search_decoder(const LogProbsView& probs_seq, const DecoderOptions& options);
 
 /* CTC Beam Search Decoder for batch data
 
  * Parameters:
- *     probs_seq: 3-D vector that each element is a 2-D vector that can be used
- *                by ctc_beam_search_decoder().
- *     beam_size: The width of beam search.
- *     num_processes: Number of threads for beam search.
- *     cutoff_prob: Cutoff probability for pruning.
- *     cutoff_top_n: Cutoff number for pruning.
+ *     probs_split: vector of 2-D views, each of which can be used by
+ *                  ctc_beam_search_decoder().
+ *     num_processes: Maximum number of threads of the shared pool used for
+ *                    this batch.
+ *     options: Settings of the beam search.
  * Return:
  *     A 2-D vector that each element is a vector of beam search decoding
  *     result for one audio sample.
 */
 std::vector<std::vector<Output>> ctc_beam_search_decoder_batch(
-    const std::vector<std::vector<std::vector<float>>>& probs_split,
-    int beam_size,
-    size_t num_processes,
-    float cutoff_prob = 1.0,
-    size_t cutoff_top_n = 40,
-    size_t blank_id = 0);
+    const std::vector<LogProbsView>& probs_split, size_t num_processes, const DecoderOptions& options);
+
+/* Same as ctc_beam_search_decoder_batch, with the n-best of every sample as a
+ * Lattice. options.segment_blank_frames doesn't apply.
+ */
+std::vector<Lattice> ctc_beam_search_lattice_batch(
+    const std::vector<LogProbsView>& probs_split, size_t num_processes, const DecoderOptions& options);
+
+/* Process-wide thread pool shared by all batch decoding calls, created on first
+ * use and kept alive until exit so that a call only pays for task submission.
+ */
+thread_pool& get_thread_pool();
+
+/* Set the number of workers of the shared thread pool. 0 means one per hardware
+ * thread. It can only be changed before the pool has been created.
+ */
+void set_num_threads(size_t num_threads);
+
+size_t get_num_threads();
+
+/* Share of a frame's expansion done by one thread: the nodes it allocates, the
+ * ones it activates, and its additions to prefixes of the beam, which other
+ * threads may be updating and are applied once all of them are done.
+ */
+struct ExpansionPartition
+{
+    PathTrieArena nodes;
+    std::vector<PathTrie*> activated;
+    // index in the pruned frame of the character each activated node was created for
+    std::vector<size_t> activated_chars;
+    std::vector<std::pair<PathTrie*, float>> deferred;
+    LexiconMatcher lexicon;
+    LanguageModelScorer language_model;
+};
+
+/* Buffers and trie nodes of a DecoderState that are kept warm between
+ * utterances, so that steady-state decoding does close to no heap allocations.
+ * A workspace is used by at most one DecoderState at a time.
+ */
+struct DecoderWorkspace
+{
+    bool in_use = false;
+    std::vector<PathTrie*> prefixes;
+    std::vector<PathTrie*> activated;
+    PrunedLogProbs pruned;
+    PathTrieArena nodes;
+    std::vector<std::unique_ptr<ExpansionPartition>> partitions;
+    std::vector<size_t> partition_positions;
+    HashedBeamStorage hashed;
+    // bound to the lexicon and the language model of the state using the workspace, if it has them
+    LexiconMatcher lexicon;
+    LanguageModelScorer language_model;
+
+    // workspace of the calling thread, i.e. of the worker when called from the thread pool
+    static DecoderWorkspace& for_this_thread();
+};
 
 class DecoderState
 {
     int abs_time_step;
-    size_t beam_size;
-    float cutoff_prob;
-    size_t cutoff_top_n;
-    size_t blank_id;
+    DecoderOptions options;
 
-    std::vector<PathTrie*> prefixes;
-    PathTrie root;
+    std::unique_ptr<DecoderWorkspace> own_workspace;
+    DecoderWorkspace* workspace;
+    PathTrie* root;
+    // first prefix of the beam in the order of decode(), kept up to date by next()
+    PathTrie* best_prefix;
+    std::vector<int> committed_tokens, committed_timesteps;
+
+    // drop the prefixes that branched off the best one more than options.max_uncommitted_frames ago
+    void drop_stale_prefixes();
+
+    // the prefixes of decode(), best first
+    std::vector<PathTrie*> sorted_prefixes() const;
+
+    // next(), for the log-add policy of options.merge_mode
+    template <typename LogAdd>
+    void expand(const PrunedLogProbs& pruned, LogAdd log_add);
+
+    // expand prefixes [begin, end) of the beam with frame time_step, into the
+    // workspace or, when running alongside other threads, into partition
+    template <typename LogAdd>
+    void expand_prefixes(
+        const PrunedLogProbs& pruned,
+        size_t time_step,
+        size_t begin,
+        size_t end,
+        float best_score,
+        float min_cutoff,
+        ExpansionPartition* partition,
+        LogAdd log_add);
+
+    // same as expand_prefixes over the whole beam, split among num_partitions threads
+    template <typename LogAdd>
+    void expand_prefixes_in_parallel(
+        const PrunedLogProbs& pruned,
+        size_t time_step,
+        size_t num_prefixes,
+        float best_score,
+        float min_cutoff,
+        size_t num_partitions,
+        LogAdd log_add);
 
 public:
     /* Initialize CTC beam search decoder for streaming
      *
      * Parameters:
-     *     beam_size: The width of beam search.
-     *     cutoff_prob: Cutoff probability for pruning.
-     *     cutoff_top_n: Cutoff number for pruning.
+     *     options: Settings of the beam search, options.engine is ignored.
+     *     workspace: Buffers to borrow for the lifetime of the state, a private
+     *                one is allocated if it is null or already in use.
+     */
+    DecoderState(const DecoderOptions& options, DecoderWorkspace* workspace = nullptr);
+
+    /* Restore a state from snapshot(), with its options. Decoding goes on
+     * exactly as it would have in the state the snapshot was taken of. Throws
+     * std::invalid_argument if the snapshot is corrupt or isn't of a
+     * DecoderState.
      */
-    DecoderState(size_t beam_size, float cutoff_prob, size_t cutoff_top_n, size_t blank_id);
-    ~DecoderState() = default;
+    DecoderState(const std::string& snapshot, DecoderWorkspace* workspace = nullptr);
+    DecoderState(const DecoderState&) = delete;
+    DecoderState& operator=(const DecoderState&) = delete;
+    ~DecoderState();
 
     /* Process logits in decoder stream
      *
      * Parameters:
-     *     probs: 2-D vector where each element is a vector of probabilities
-     *               over alphabet of one time step.
+     *     probs_seq: 2-D view of log probabilities, each row is the distribution
+     *               over alphabet of one time step. It is only read during the call.
+     */
+    void next(const LogProbsView& probs_seq);
+
+    /* Process frames whose vocabulary has already been pruned with
+     * prune_log_probs and the cutoffs of the options, which lets the pruning
+     * of the next frames run ahead on another thread.
      */
-    void next(const std::vector<std::vector<float>>& probs_seq);
+    void next(const PrunedLogProbs& pruned);
 
     /* Get current transcription from the decoder stream state
      *
@@ -85,4 +185,41 @@ public:
      *     in descending order.
      */
     std::vector<Output> decode() const;
+
+    /* Same as decode(), without the committed tokens, so that its cost only
+     * depends on the part of the stream the beam doesn't agree on yet.
+     */
+    std::vector<Output> decode_uncommitted() const;
+
+    /* The num_results best candidates, for partial results polled while
+     * streaming. The beam is only partially sorted, and not at all for the
+     * best candidate, which next() keeps track of. Candidates whose scores
+     * and last tokens tie may come out in another order than with decode().
+     */
+    std::vector<Output> decode_best(size_t num_results, bool uncommitted_only = false) const;
+
+    /* Candidates of decode(), in the same order, as a prefix tree copied
+     * from the trie, with the committed tokens as its trunk.
+     */
+    Lattice decode_lattice() const;
+
+    /* Compact binary copy of the state, e.g. to move a stream to another
+     * process: the options, the committed tokens and the part of the trie
+     * below them, whose size is bounded by the beam rather than the stream.
+     */
+    std::string snapshot() const;
+
+    /* Tokens, and their timesteps, that every prefix of the beam starts with.
+     * They are final, and the trie only keeps the nodes below them, so that
+     * its size doesn't grow with the length of the stream.
+     */
+    const std::vector<int>& get_committed_tokens() const
+    {
+        return committed_tokens;
+    }
+
+    const std::vector<int>& get_committed_timesteps() const
+    {
+        return committed_timesteps;
+    }
 };
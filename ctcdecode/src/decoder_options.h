@@ -0,0 +1,102 @@
+#pragma once
+#include <cstddef>
+#include <limits>
+#include <memory>
+
+class LanguageModel;
+class Lexicon;
+
+// Data structure holding the beam during the search
+enum class BeamEngine
+{
+    // prefixes are nodes of a pointer-linked PathTrie
+    trie,
+    // prefixes live in flat arrays and are merged through a hash table, see hashed_beam_search.h
+    hashed,
+};
+
+// How the probabilities of the paths merging into a prefix are added up
+enum class MergeMode
+{
+    // log_sum_exp, as exact as float allows
+    exact,
+    // log_sum_exp_fast, within 1e-6 of exact and a lot cheaper
+    fast,
+    // max, i.e. the score of the best alignment of a prefix rather than the sum over all of them, without any exp
+    // or log, for keyword spotting and alignment where the difference doesn't matter
+    max,
+};
+
+/* Settings of a beam search, shared by the batch and the streaming decoders
+ *
+ *     beam_size: The width of beam search.
+ *     cutoff_prob: Cutoff probability for pruning.
+ *     cutoff_top_n: Cutoff number for pruning.
+ *     blank_id: Index of the CTC blank label.
+ *     engine: Data structure holding the beam, both give the same results.
+ *     merge_mode: Accuracy of the additions of path probabilities.
+ *     blank_skip_threshold: Frames whose blank probability is at least this
+ *                           are not expanded, a run of them only adds its
+ *                           blank log probability to the scores of the beam.
+ *                           1 or more disables it.
+ *     beam_threshold: Prefixes and extensions scoring more than this below
+ *                     the best one are dropped, so that easy frames keep a
+ *                     smaller beam than beam_size. Infinite by default,
+ *                     the best prefix is never dropped.
+ *     num_expansion_threads: Maximum number of threads of the shared pool
+ *                            expanding the beam of a frame together, for
+ *                            large beams and vocabularies. The results don't
+ *                            depend on it. Only the trie engine uses it.
+ *     segment_blank_frames: Cut the input in the middle of every run of at
+ *                           least this many frames whose blank probability
+ *                           is at least segment_blank_threshold, and decode
+ *                           the segments concurrently. 0 disables it.
+ *                           Segments start from scratch, so inputs are
+ *                           decoded in one pass with a lexicon or a
+ *                           language model, whose words may span a cut.
+ *     segment_blank_threshold: See segment_blank_frames.
+ *     max_uncommitted_frames: Drop the prefixes that branched off the best one
+ *                             more than about this many frames ago, so that
+ *                             the beam agrees on everything older and a long
+ *                             stream only keeps a bounded tail. 0 only
+ *                             commits what the beam agrees on by itself.
+ *     endpoint_blank_frames: Streams end a segment at a pause of at least this
+ *                            many frames whose blank probability is at least
+ *                            endpoint_blank_threshold, if the best path didn't
+ *                            change during it, see StreamDecoder. 0 disables it.
+ *     endpoint_blank_threshold: See endpoint_blank_frames.
+ *     endpoint_score_margin: Only end a segment if the best path also leads
+ *                            the second best by at least this much, in log
+ *                            probability, i.e. the beam settled on it. 0
+ *                            disables the check.
+ *     lexicon: Constrains the prefixes to sequences of its words, see
+ *              Lexicon. Shared by the decoders using the options, null by
+ *              default.
+ *     language_model: Adds lm_alpha times the log probability of every word
+ *                     of a prefix under the model, and lm_beta, to its
+ *                     score. See LanguageModel, null by default.
+ *     lm_alpha: See language_model.
+ *     lm_beta: See language_model.
+ */
+struct DecoderOptions
+{
+    size_t beam_size = 100;
+    float cutoff_prob = 1.0;
+    size_t cutoff_top_n = 40;
+    size_t blank_id = 0;
+    BeamEngine engine = BeamEngine::trie;
+    MergeMode merge_mode = MergeMode::exact;
+    float blank_skip_threshold = 1.0;
+    float beam_threshold = std::numeric_limits<float>::infinity();
+    size_t num_expansion_threads = 1;
+    size_t segment_blank_frames = 0;
+    float segment_blank_threshold = 0.999;
+    size_t max_uncommitted_frames = 0;
+    size_t endpoint_blank_frames = 0;
+    float endpoint_blank_threshold = 0.99;
+    float endpoint_score_margin = 0.0;
+    std::shared_ptr<const Lexicon> lexicon;
+    std::shared_ptr<const LanguageModel> language_model;
+    float lm_alpha = 0.0;
+    float lm_beta = 0.0;
+};
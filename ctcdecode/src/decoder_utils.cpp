@@ -5,90 +5,158 @@
 #include <limits>
 using namespace std;
 
-vector<pair<size_t, float>> get_pruned_log_probs(const vector<float>& prob_step, float cutoff_prob, size_t cutoff_top_n)
+namespace
 {
-    vector<pair<int, float>> prob_idx;
-    prob_idx.reserve(prob_step.size());
-    const float log_cutoff_prob = log(cutoff_prob);
-    for (size_t i = 0; i < prob_step.size(); ++i)
-    {
-        prob_idx.push_back(pair<int, float>(i, prob_step[i]));
-    }
+// values are tested against the running threshold this many at a time
+const size_t FILTER_BLOCK_SIZE = 16;
+
+// decreasing log probability, increasing class on ties
+bool candidate_greater(const pair<float, int>& x, const pair<float, int>& y)
+{
+    return x.first > y.first || (x.first == y.first && x.second < y.second);
+}
+
+// Move the k best of values[0, num_classes) to the front of candidates, sorted,
+// and return how many there are. Values below the k-th best seen so far are
+// dropped as they stream by, so the selection only ever works on O(k) of them.
+size_t select_top_k(const float* values, size_t num_classes, size_t k, vector<pair<float, int>>& candidates)
+{
+    candidates.resize(max<size_t>(2 * k, k + FILTER_BLOCK_SIZE));
+    const size_t capacity = candidates.size();
+    float threshold = -numeric_limits<float>::infinity();
+    size_t num_candidates = 0;
 
-    // pruning of vacobulary
-    size_t cutoff_len = prob_step.size();
-    if (log_cutoff_prob < 0.0 || cutoff_top_n < cutoff_len)
+    for (size_t block = 0; block < num_classes; block += FILTER_BLOCK_SIZE)
     {
-        sort(prob_idx.begin(), prob_idx.end(), [](const auto& a, const auto& b) { return a.second > b.second; });
-        if (log_cutoff_prob < 0.0)
+        const size_t block_end = min(block + FILTER_BLOCK_SIZE, num_classes);
+
+        // once the threshold has settled most blocks have nothing above it, the test is branch free so it vectorizes
+        bool any_above = false;
+        for (size_t i = block; i < block_end; ++i)
         {
-            float cum_prob = 0.0f;
-            cutoff_len = 0;
-            for (size_t i = 0; i < prob_idx.size(); ++i)
-            {
-                cum_prob = log_sum_exp(cum_prob, prob_idx[i].second);
-                cutoff_len += 1;
-                if (cum_prob >= cutoff_prob || cutoff_len >= cutoff_top_n)
-                    break;
-            }
+            any_above |= values[i] >= threshold;
         }
-        else
+        if (!any_above)
+            continue;
+
+        for (size_t i = block; i < block_end; ++i)
         {
-            cutoff_len = cutoff_top_n;
+            // always written, only kept when above the threshold
+            candidates[num_candidates] = { values[i], static_cast<int>(i) };
+            num_candidates += values[i] >= threshold;
+            if (num_candidates == capacity)
+            {
+                nth_element(
+                    candidates.begin(),
+                    candidates.begin() + (k - 1),
+                    candidates.begin() + num_candidates,
+                    candidate_greater);
+                threshold = candidates[k - 1].first;
+                num_candidates = k;
+            }
         }
-        prob_idx.resize(cutoff_len);
     }
 
-    vector<pair<size_t, float>> log_prob_idx;
-    for (size_t i = 0; i < cutoff_len; ++i)
+    if (num_candidates > k)
     {
-        log_prob_idx.push_back(pair<int, float>(prob_idx[i].first, prob_idx[i].second));
+        nth_element(
+            candidates.begin(), candidates.begin() + (k - 1), candidates.begin() + num_candidates, candidate_greater);
+        num_candidates = k;
     }
-    return log_prob_idx;
+    sort(candidates.begin(), candidates.begin() + num_candidates, candidate_greater);
+    return num_candidates;
+}
 }
 
-vector<Output> get_beam_search_result(const vector<PathTrie*>& prefixes, size_t beam_size)
+void prune_log_probs(
+    const LogProbsView& probs_seq, size_t begin, size_t end, const DecoderOptions& options, PrunedLogProbs& pruned)
 {
-    // allow for the post processing
-    vector<PathTrie*> space_prefixes(prefixes.begin(), prefixes.begin() + min(beam_size, prefixes.size()));
+    const size_t num_classes = probs_seq.num_classes;
+    const float cutoff_prob = options.cutoff_prob;
+    const size_t cutoff_top_n = options.cutoff_top_n;
+    const float log_cutoff_prob = log(cutoff_prob);
+    const bool prune = log_cutoff_prob < 0.0 || cutoff_top_n < num_classes;
+    const size_t top_n = min(cutoff_top_n, num_classes);
+    const bool skip_blanks = options.blank_skip_threshold < 1.0f && options.blank_id < num_classes;
+    const float log_blank_skip_threshold = log(options.blank_skip_threshold);
 
-    sort(space_prefixes.begin(), space_prefixes.end(), prefix_compare);
-    vector<Output> output_vecs;
-    output_vecs.reserve(space_prefixes.size());
-    for (size_t i = 0; i < beam_size && i < space_prefixes.size(); ++i)
+    pruned.offsets.assign(1, 0);
+    pruned.indices.clear();
+    pruned.log_probs.clear();
+    pruned.blank_frames.assign(end - begin, 0);
+    if (prune && top_n == 0)
     {
-        vector<int> tokens;
-        vector<int> timesteps;
-        space_prefixes[i]->get_path_vec(tokens, timesteps);
-        output_vecs.emplace_back(-space_prefixes[i]->approx_ctc, tokens, timesteps);
+        pruned.offsets.resize(end - begin + 1, 0);
+        return;
     }
 
-    return output_vecs;
-}
-
-bool prefix_compare(const PathTrie* x, const PathTrie* y)
-{
-    if (x->score == y->score)
+    for (size_t t = begin; t < end; ++t)
     {
-        if (x->character == y->character)
+        if (skip_blanks)
         {
-            return false;
+            // no need to look at the rest of a frame that is confidently blank
+            float blank_log_prob = probs_seq(t, options.blank_id);
+            if (blank_log_prob >= log_blank_skip_threshold)
+            {
+                pruned.blank_frames[t - begin] = 1;
+                pruned.indices.push_back(static_cast<int>(options.blank_id));
+                pruned.log_probs.push_back(blank_log_prob);
+                pruned.offsets.push_back(pruned.indices.size());
+                continue;
+            }
         }
-        else
+
+        const float* values = probs_seq.row(t);
+        if (probs_seq.class_stride != 1)
         {
-            return (x->character < y->character);
+            // gather strided rows once, so that the passes below read contiguous memory
+            pruned.row_buffer.resize(num_classes);
+            for (size_t i = 0; i < num_classes; ++i)
+            {
+                pruned.row_buffer[i] = probs_seq(t, i);
+            }
+            values = pruned.row_buffer.data();
         }
-    }
-    else
-    {
-        return x->score > y->score;
+
+        if (!prune)
+        {
+            for (size_t i = 0; i < num_classes; ++i)
+            {
+                pruned.indices.push_back(static_cast<int>(i));
+                pruned.log_probs.push_back(values[i]);
+            }
+            pruned.offsets.push_back(pruned.indices.size());
+            continue;
+        }
+
+        // pruning of vacobulary
+        size_t cutoff_len = select_top_k(values, num_classes, top_n, pruned.candidates);
+        if (log_cutoff_prob < 0.0)
+        {
+            float cum_prob = 0.0f;
+            size_t num_selected = cutoff_len;
+            cutoff_len = 0;
+            for (size_t i = 0; i < num_selected; ++i)
+            {
+                cum_prob = log_sum_exp(cum_prob, pruned.candidates[i].first);
+                cutoff_len += 1;
+                if (cum_prob >= cutoff_prob || cutoff_len >= cutoff_top_n)
+                    break;
+            }
+        }
+
+        for (size_t i = 0; i < cutoff_len; ++i)
+        {
+            pruned.indices.push_back(pruned.candidates[i].second);
+            pruned.log_probs.push_back(pruned.candidates[i].first);
+        }
+        pruned.offsets.push_back(pruned.indices.size());
     }
 }
 
-bool prefix_compare_external_scores(
-    const PathTrie* x, const PathTrie* y, const unordered_map<const PathTrie*, float>& scores)
+bool prefix_compare(const PathTrie* x, const PathTrie* y)
 {
-    if (scores.at(x) == scores.at(y))
+    if (x->score == y->score)
     {
         if (x->character == y->character)
         {
@@ -101,6 +169,6 @@ bool prefix_compare_external_scores(
     }
     else
     {
-        return scores.at(x) > scores.at(y);
+        return x->score > y->score;
     }
 }
@@ -1,10 +1,13 @@
 #pragma once
 
-#include <unordered_map>
+#include <cstdint>
+#include <cstring>
 #include <utility>
 #include <vector>
 
+#include "decoder_options.h"
 #include "fst/log.h"
+#include "log_probs_view.h"
 #include "output.h"
 #include "path_trie.h"
 
@@ -29,7 +32,7 @@ inline void check(bool x, const char* expr, const char* file, int line, const ch
 template <typename T>
 T log_sum_exp(const T& x, const T& y)
 {
-    static T num_min = -std::numeric_limits<T>::max();
+    const T num_min = -std::numeric_limits<T>::max();
     if (x <= num_min)
         return y;
     if (y <= num_min)
@@ -38,15 +41,145 @@ T log_sum_exp(const T& x, const T& y)
     return std::log(std::exp(x - xmax) + std::exp(y - xmax)) + xmax;
 }
 
-// Get pruned probability vector for each time step's beam search
-std::vector<std::pair<size_t, float>>
-get_pruned_log_probs(const std::vector<float>& prob_step, float cutoff_prob, size_t cutoff_top_n);
+// Beyond this difference of log probabilities the smaller one adds less than 1e-34
+const float LOG_ADD_MAX_DIFF = 80.0f;
 
-// Get beam search result from prefixes in trie tree
-std::vector<Output> get_beam_search_result(const std::vector<PathTrie*>& prefixes, size_t beam_size);
+// log(1 + exp(-d)) for d in [0, LOG_ADD_MAX_DIFF], within 1e-6. Branch free
+// and without calls into libm, so that loops over it vectorize.
+inline float log1p_exp_neg(float d)
+{
+    // exp(-d) = 2^n * 2^f with n an integer and f in (-0.5, 0.5]
+    const float x = -d * 1.44269504f;
+    const int n = static_cast<int>(x - 0.5f);
+    const float f = x - static_cast<float>(n);
+    float p = 1.5403530e-4f;
+    p = p * f + 1.3333558e-3f;
+    p = p * f + 9.6181291e-3f;
+    p = p * f + 5.5504109e-2f;
+    p = p * f + 2.4022651e-1f;
+    p = p * f + 6.9314718e-1f;
+    p = p * f + 1.0f;
+    const int32_t bits = (n + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    const float e = p * scale;
+
+    // log(1 + e) = 2 atanh(s) with s = e / (2 + e) in [0, 1/3]
+    const float s = e / (2.0f + e);
+    const float s2 = s * s;
+    float q = 1.0f / 11;
+    q = q * s2 + 1.0f / 9;
+    q = q * s2 + 1.0f / 7;
+    q = q * s2 + 1.0f / 5;
+    q = q * s2 + 1.0f / 3;
+    q = q * s2 + 1.0f;
+    return 2.0f * s * q;
+}
+
+// Approximate log_sum_exp for floats, off by at most 1e-6 more than it. Unlike log_sum_exp it
+// needs no branch for -NUM_FLT_INF: a huge difference adds nothing.
+inline float log_sum_exp_fast(float x, float y)
+{
+    float xmax = std::max(x, y);
+    // NaN when both are -inf, which min turns into LOG_ADD_MAX_DIFF as well
+    float d = std::min(LOG_ADD_MAX_DIFF, xmax - std::min(x, y));
+    return xmax + log1p_exp_neg(d);
+}
+
+// Log-add policies of the beam search, the decoders are instantiated once per
+// MergeMode so that choosing one costs nothing per operation
+struct ExactLogAdd
+{
+    float operator()(float x, float y) const
+    {
+        return log_sum_exp(x, y);
+    }
+};
+
+struct FastLogAdd
+{
+    float operator()(float x, float y) const
+    {
+        return log_sum_exp_fast(x, y);
+    }
+};
+
+struct MaxLogAdd
+{
+    float operator()(float x, float y) const
+    {
+        return std::max(x, y);
+    }
+};
+
+// acc[i] = log_add(acc[i], values[i] + offset) for i in [0, n), which
+// vectorizes with FastLogAdd, for merging a path into a whole beam at once
+template <typename LogAdd>
+void log_sum_exp_n(float* acc, const float* values, float offset, size_t n, LogAdd log_add)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        acc[i] = log_add(acc[i], values[i] + offset);
+    }
+}
+
+/* Vocabulary pruning of a block of frames in compressed sparse row form: the
+ * classes kept for frame t are entries [offsets[t], offsets[t + 1]) of indices
+ * and log_probs, by decreasing log probability. Filled by prune_log_probs, and
+ * independent of the beam, so that it can be computed ahead of the expansion.
+ */
+struct PrunedLogProbs
+{
+    std::vector<size_t> offsets;
+    std::vector<int> indices;
+    std::vector<float> log_probs;
+    // 1 for frames whose blank probability reaches the blank_skip_threshold,
+    // their only entry is the blank
+    std::vector<char> blank_frames;
+
+    // scratch space of prune_log_probs
+    std::vector<float> row_buffer;
+    std::vector<std::pair<float, int>> candidates;
+
+    size_t num_frames() const
+    {
+        return offsets.empty() ? 0 : offsets.size() - 1;
+    }
+
+    // highest log probability kept for frame time_step, -inf if there is none
+    float max_log_prob(size_t time_step) const
+    {
+        float max_log_prob = -std::numeric_limits<float>::infinity();
+        for (size_t index = offsets[time_step]; index < offsets[time_step + 1]; ++index)
+        {
+            max_log_prob = std::max(max_log_prob, log_probs[index]);
+        }
+        return max_log_prob;
+    }
+
+    // number of blank frames in a row from time_step on, and the sum of their blank log probabilities
+    size_t blank_run(size_t time_step, float& blank_log_prob) const
+    {
+        size_t run = 0;
+        blank_log_prob = 0.0f;
+        for (; time_step + run < blank_frames.size() && blank_frames[time_step + run]; ++run)
+        {
+            blank_log_prob += log_probs[offsets[time_step + run]];
+        }
+        return run;
+    }
+};
+
+// Number of frames pruned at once by the decoders before expanding them
+const size_t PRUNE_BLOCK_SIZE = 64;
+
+// Prune the vocabulary of frames [begin, end) of probs_seq to the cutoff_top_n
+// most probable classes, fewer if their cumulative probability reaches
+// cutoff_prob first, with the settings of options. The result replaces the
+// content of pruned, reusing its storage. Classes of equal log probability are
+// kept in increasing order.
+void prune_log_probs(
+    const LogProbsView& probs_seq, size_t begin, size_t end, const DecoderOptions& options, PrunedLogProbs& pruned);
 
 // Functor for prefix comparison
 bool prefix_compare(const PathTrie* x, const PathTrie* y);
-
-bool prefix_compare_external_scores(
-    const PathTrie* x, const PathTrie* y, const std::unordered_map<const PathTrie*, float>& scores);
@@ -0,0 +1,874 @@
+#include "hashed_beam_search.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+
+#include "ctc_beam_search_decoder.h"
+#include "decoder_utils.h"
+#include "snapshot.h"
+using namespace std;
+
+namespace
+{
+const size_t MIN_TABLE_SIZE = 1024;
+
+// same order as prefix_compare: higher score first, ties broken by the lower last token
+struct candidate_compare
+{
+    const vector<float>& scores;
+    const vector<int>& tokens;
+
+    bool operator()(int x, int y) const
+    {
+        if (scores[x] == scores[y])
+        {
+            return tokens[x] < tokens[y];
+        }
+        return scores[x] > scores[y];
+    }
+};
+}
+
+void HashedBeamStorage::clear()
+{
+    tokens.clear();
+    timesteps.clear();
+    parents.clear();
+    refs.clear();
+    log_probs_c.clear();
+    lexicon_states.clear();
+    lm_states.clear();
+    lm_scores.clear();
+    free_entries.clear();
+    slots.clear();
+
+    if (table.size() < MIN_TABLE_SIZE)
+        table.resize(MIN_TABLE_SIZE);
+    fill(table.begin(), table.end(), -1);
+    num_entries = 0;
+
+    beam_entries.clear();
+    beam_tokens.clear();
+    beam_b.clear();
+    beam_nb.clear();
+    beam_score.clear();
+}
+
+HashedDecoderState::HashedDecoderState(const DecoderOptions& options, DecoderWorkspace* workspace)
+    : abs_time_step(0)
+    , options(options)
+    , workspace(workspace)
+{
+    if (this->workspace == nullptr || this->workspace->in_use)
+    {
+        own_workspace.reset(new DecoderWorkspace);
+        this->workspace = own_workspace.get();
+    }
+    this->workspace->in_use = true;
+    this->workspace->lexicon.bind(options.lexicon);
+    this->workspace->language_model.bind(options.language_model, options.lm_alpha, options.lm_beta);
+    storage = &this->workspace->hashed;
+    storage->clear();
+
+    // the empty prefix, with an extra reference so that it is never recycled
+    int lexicon_state = options.lexicon != nullptr ? this->workspace->lexicon.start() : 0;
+    root_entry = add_entry(-1, -1, 0, -NUM_FLT_INF, lexicon_state);
+    if (options.language_model != nullptr)
+        storage->lm_states[root_entry] = this->workspace->language_model.start();
+    ++storage->refs[root_entry];
+
+    storage->beam_entries.push_back(root_entry);
+    storage->beam_tokens.push_back(-1);
+    storage->beam_b.push_back(0.0f);
+    storage->beam_nb.push_back(-NUM_FLT_INF);
+    storage->beam_score.push_back(0.0f);
+    best_index = 0;
+}
+
+HashedDecoderState::HashedDecoderState(const string& snapshot, DecoderWorkspace* workspace)
+    : HashedDecoderState(read_snapshot_options(snapshot, SnapshotKind::hashed_state), workspace)
+{
+    auto& s = *storage;
+    SnapshotReader reader(snapshot);
+    read_snapshot_header(reader, SnapshotKind::hashed_state);
+    abs_time_step = reader.read<int32_t>();
+    reader.read_vector(committed_tokens);
+    reader.read_vector(committed_timesteps);
+
+    s.clear();
+    reader.read_vector(s.tokens);
+    reader.read_vector(s.timesteps);
+    reader.read_vector(s.parents);
+    reader.read_vector(s.refs);
+    reader.read_vector(s.log_probs_c);
+    reader.read_vector(s.lexicon_states);
+    reader.read_vector(s.lm_states);
+    reader.read_vector(s.lm_scores);
+    root_entry = reader.read<int32_t>();
+    reader.read_vector(s.beam_entries);
+    reader.read_vector(s.beam_tokens);
+    reader.read_vector(s.beam_b);
+    reader.read_vector(s.beam_nb);
+    reader.read_vector(s.beam_score);
+
+    const int num_entries = static_cast<int>(s.tokens.size());
+    const size_t beam_size = s.beam_entries.size();
+    bool valid = committed_tokens.size() == committed_timesteps.size() && s.timesteps.size() == s.tokens.size()
+        && s.parents.size() == s.tokens.size() && s.refs.size() == s.tokens.size()
+        && s.log_probs_c.size() == s.tokens.size() && s.lexicon_states.size() == s.tokens.size()
+        && s.lm_states.size() == s.tokens.size() && s.lm_scores.size() == s.tokens.size()
+        && s.beam_tokens.size() == beam_size
+        && s.beam_b.size() == beam_size && s.beam_nb.size() == beam_size && s.beam_score.size() == beam_size
+        && beam_size > 0 && root_entry >= 0 && root_entry < num_entries && s.parents[root_entry] == -1
+        && reader.at_end();
+    // parents come first, so that every history ends at the root
+    for (int entry = 0; valid && entry < num_entries; ++entry)
+    {
+        valid = entry == root_entry ? s.parents[entry] == -1 : s.parents[entry] >= 0 && s.parents[entry] < entry;
+        if (options.lexicon != nullptr)
+            valid = valid && options.lexicon->is_valid(s.lexicon_states[entry]);
+        else
+            valid = valid && s.lexicon_states[entry] == 0;
+        if (options.language_model != nullptr)
+            valid = valid && options.language_model->is_valid(s.lm_states[entry]);
+    }
+    for (size_t i = 0; valid && i < beam_size; ++i)
+    {
+        valid = s.beam_entries[i] >= 0 && s.beam_entries[i] < num_entries;
+    }
+    // every entry is referenced by its children and the prefixes of the beam, which are distinct, and the root once
+    // more, otherwise entries would be recycled while still in use
+    vector<int> refs(valid ? num_entries : 0, 0);
+    vector<bool> in_beam(refs.size(), false);
+    for (int entry = 0; valid && entry < num_entries; ++entry)
+    {
+        ++refs[entry == root_entry ? entry : s.parents[entry]];
+    }
+    for (size_t i = 0; valid && i < beam_size; ++i)
+    {
+        valid = !in_beam[s.beam_entries[i]];
+        in_beam[s.beam_entries[i]] = true;
+        ++refs[s.beam_entries[i]];
+    }
+    valid = valid && refs == s.refs;
+    if (!valid)
+        throw invalid_argument("corrupt decoder snapshot");
+
+    s.slots.assign(s.tokens.size(), -1);
+    for (int entry = 0; entry < num_entries; ++entry)
+    {
+        if (entry == root_entry)
+            continue;
+        if (find(s.parents[entry], s.tokens[entry]) >= 0)
+            throw invalid_argument("corrupt decoder snapshot");
+        insert_into_table(entry);
+    }
+    best_index = find_best();
+}
+
+HashedDecoderState::~HashedDecoderState()
+{
+    workspace->lexicon.bind(nullptr);
+    workspace->language_model.bind(nullptr, 0.0f, 0.0f);
+    workspace->in_use = false;
+}
+
+size_t HashedDecoderState::home_bucket(int parent, int token) const
+{
+    uint64_t key = (static_cast<uint64_t>(static_cast<uint32_t>(parent)) << 32) | static_cast<uint32_t>(token);
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key & (storage->table.size() - 1);
+}
+
+int HashedDecoderState::find_best() const
+{
+    // first of the best ones, like min_element
+    candidate_compare compare { storage->beam_score, storage->beam_tokens };
+    int best = 0;
+    for (int i = 1; i < static_cast<int>(storage->beam_entries.size()); ++i)
+    {
+        if (compare(i, best))
+        {
+            best = i;
+        }
+    }
+    return best;
+}
+
+int HashedDecoderState::find(int parent, int token) const
+{
+    const auto& table = storage->table;
+    const size_t mask = table.size() - 1;
+    for (size_t bucket = home_bucket(parent, token);; bucket = (bucket + 1) & mask)
+    {
+        int entry = table[bucket];
+        if (entry < 0 || (storage->parents[entry] == parent && storage->tokens[entry] == token))
+        {
+            return entry;
+        }
+    }
+}
+
+void HashedDecoderState::insert_into_table(int entry)
+{
+    auto& table = storage->table;
+    if ((storage->num_entries + 1) * 2 > table.size())
+    {
+        vector<int> old_table(table.size() * 2, -1);
+        old_table.swap(table);
+        storage->num_entries = 0;
+        for (int old_entry : old_table)
+        {
+            if (old_entry >= 0)
+            {
+                insert_into_table(old_entry);
+            }
+        }
+    }
+
+    const size_t mask = table.size() - 1;
+    size_t bucket = home_bucket(storage->parents[entry], storage->tokens[entry]);
+    while (table[bucket] >= 0)
+    {
+        bucket = (bucket + 1) & mask;
+    }
+    table[bucket] = entry;
+    ++storage->num_entries;
+}
+
+void HashedDecoderState::erase_from_table(int entry)
+{
+    auto& table = storage->table;
+    const size_t mask = table.size() - 1;
+    size_t hole = home_bucket(storage->parents[entry], storage->tokens[entry]);
+    while (table[hole] != entry)
+    {
+        hole = (hole + 1) & mask;
+    }
+
+    // shift back the following entries of the cluster that can't be found anymore past the hole
+    for (size_t bucket = (hole + 1) & mask; table[bucket] >= 0; bucket = (bucket + 1) & mask)
+    {
+        size_t home = home_bucket(storage->parents[table[bucket]], storage->tokens[table[bucket]]);
+        bool reachable = hole <= bucket ? (hole < home && home <= bucket) : (hole < home || home <= bucket);
+        if (!reachable)
+        {
+            table[hole] = table[bucket];
+            hole = bucket;
+        }
+    }
+    table[hole] = -1;
+    --storage->num_entries;
+}
+
+int HashedDecoderState::add_entry(int parent, int token, int timestep, float log_prob_c, int lexicon_state)
+{
+    auto& s = *storage;
+    int entry;
+    if (!s.free_entries.empty())
+    {
+        entry = s.free_entries.back();
+        s.free_entries.pop_back();
+    }
+    else
+    {
+        entry = static_cast<int>(s.tokens.size());
+        s.tokens.push_back(0);
+        s.timesteps.push_back(0);
+        s.parents.push_back(0);
+        s.refs.push_back(0);
+        s.log_probs_c.push_back(0.0f);
+        s.lexicon_states.push_back(0);
+        s.lm_states.push_back(LanguageModelState { 0, 0 });
+        s.lm_scores.push_back(0.0f);
+        s.slots.push_back(-1);
+    }
+
+    s.tokens[entry] = token;
+    s.timesteps[entry] = timestep;
+    s.parents[entry] = parent;
+    s.log_probs_c[entry] = log_prob_c;
+    s.lexicon_states[entry] = lexicon_state;
+    s.lm_states[entry] = LanguageModelState { 0, 0 };
+    s.lm_scores[entry] = 0.0f;
+    s.slots[entry] = -1;
+    // referenced by the candidates it is about to join
+    s.refs[entry] = 1;
+
+    if (parent >= 0)
+    {
+        ++s.refs[parent];
+        insert_into_table(entry);
+    }
+    return entry;
+}
+
+void HashedDecoderState::release_entry(int entry)
+{
+    // recycle entries nothing refers to anymore, which may leave their parent unreferenced as well
+    auto& s = *storage;
+    while (entry >= 0 && --s.refs[entry] == 0)
+    {
+        int parent = s.parents[entry];
+        erase_from_table(entry);
+        s.free_entries.push_back(entry);
+        entry = parent;
+    }
+}
+
+void HashedDecoderState::next(const LogProbsView& probs_seq)
+{
+    for (size_t begin = 0; begin < probs_seq.size(); begin += PRUNE_BLOCK_SIZE)
+    {
+        size_t end = min(begin + PRUNE_BLOCK_SIZE, probs_seq.size());
+        prune_log_probs(probs_seq, begin, end, options, workspace->pruned);
+        next(workspace->pruned);
+    }
+}
+
+void HashedDecoderState::next(const PrunedLogProbs& pruned)
+{
+    switch (options.merge_mode)
+    {
+    case MergeMode::exact:
+        expand(pruned, ExactLogAdd());
+        break;
+    case MergeMode::fast:
+        expand(pruned, FastLogAdd());
+        break;
+    case MergeMode::max:
+        expand(pruned, MaxLogAdd());
+        break;
+    }
+
+    best_index = find_best();
+    drop_stale_prefixes();
+    commit_stable_prefix();
+}
+
+void HashedDecoderState::drop_stale_prefixes()
+{
+    if (options.max_uncommitted_frames == 0)
+        return;
+
+    // same as DecoderState
+    auto& s = *storage;
+    const int horizon = abs_time_step - static_cast<int>(options.max_uncommitted_frames);
+    int anchor = s.beam_entries[best_index];
+    while (anchor != root_entry && s.timesteps[anchor] > horizon)
+    {
+        anchor = s.parents[anchor];
+    }
+    if (anchor == root_entry)
+        return;
+
+    size_t num_kept = 0;
+    for (size_t i = 0; i < s.beam_entries.size(); ++i)
+    {
+        int entry = s.beam_entries[i];
+        while (entry != anchor && entry != root_entry)
+        {
+            entry = s.parents[entry];
+        }
+        if (entry != anchor)
+        {
+            release_entry(s.beam_entries[i]);
+            continue;
+        }
+        if (static_cast<int>(i) == best_index)
+        {
+            best_index = static_cast<int>(num_kept);
+        }
+        s.beam_entries[num_kept] = s.beam_entries[i];
+        s.beam_tokens[num_kept] = s.beam_tokens[i];
+        s.beam_b[num_kept] = s.beam_b[i];
+        s.beam_nb[num_kept] = s.beam_nb[i];
+        s.beam_score[num_kept] = s.beam_score[i];
+        ++num_kept;
+    }
+    s.beam_entries.resize(num_kept);
+    s.beam_tokens.resize(num_kept);
+    s.beam_b.resize(num_kept);
+    s.beam_nb.resize(num_kept);
+    s.beam_score.resize(num_kept);
+}
+
+void HashedDecoderState::commit_stable_prefix()
+{
+    auto& s = *storage;
+
+    // path of the first prefix of the beam, every entry on it marked with its depth
+    s.path.clear();
+    for (int entry = s.beam_entries[0]; entry != root_entry; entry = s.parents[entry])
+    {
+        s.path.push_back(entry);
+    }
+    s.path.push_back(root_entry);
+    reverse(s.path.begin(), s.path.end());
+    for (size_t i = 0; i < s.path.size(); ++i)
+    {
+        s.slots[s.path[i]] = static_cast<int>(i);
+    }
+
+    // deepest entry of the path the other prefixes go through as well
+    int depth = static_cast<int>(s.path.size()) - 1;
+    for (size_t i = 1; i < s.beam_entries.size() && depth > 0; ++i)
+    {
+        int entry = s.beam_entries[i];
+        while (s.slots[entry] < 0)
+        {
+            entry = s.parents[entry];
+        }
+        depth = min(depth, s.slots[entry]);
+    }
+    for (int entry : s.path)
+    {
+        s.slots[entry] = -1;
+    }
+    if (depth == 0)
+        return;
+
+    // the entries above the new root are only referenced by their one child, and no prefix can extend them anymore,
+    // so their timesteps are final
+    for (int i = 1; i <= depth; ++i)
+    {
+        committed_tokens.push_back(s.tokens[s.path[i]]);
+        committed_timesteps.push_back(s.timesteps[s.path[i]]);
+        erase_from_table(s.path[i]);
+    }
+    for (int i = 0; i < depth; ++i)
+    {
+        s.free_entries.push_back(s.path[i]);
+    }
+
+    // the new root keeps its token, which the repeated character rule of its extensions needs
+    root_entry = s.path[depth];
+    s.parents[root_entry] = -1;
+    ++s.refs[root_entry];
+}
+
+template <typename LogAdd>
+void HashedDecoderState::expand(const PrunedLogProbs& pruned, LogAdd log_add)
+{
+    auto& s = *storage;
+    LexiconMatcher* lexicon = options.lexicon != nullptr ? &workspace->lexicon : nullptr;
+    LanguageModelScorer* language_model = options.language_model != nullptr ? &workspace->language_model : nullptr;
+
+    auto add_candidate = [&s](int entry) {
+        s.slots[entry] = static_cast<int>(s.cand_entries.size());
+        s.cand_entries.push_back(entry);
+        s.cand_tokens.push_back(s.tokens[entry]);
+        s.cand_b.push_back(-NUM_FLT_INF);
+        s.cand_nb.push_back(-NUM_FLT_INF);
+        return s.slots[entry];
+    };
+
+    // prefix search over time
+    for (size_t time_step = 0; time_step < pruned.num_frames(); ++time_step, ++abs_time_step)
+    {
+        float blank_log_prob;
+        size_t blank_run = pruned.blank_run(time_step, blank_log_prob);
+        if (blank_run > 0)
+        {
+            // skip a run of blank frames like DecoderState does
+            for (size_t i = 0; i < s.beam_entries.size(); ++i)
+            {
+                s.beam_b[i] = s.beam_score[i] + blank_log_prob;
+                s.beam_nb[i] = -NUM_FLT_INF;
+                s.beam_score[i] = s.beam_b[i];
+            }
+            time_step += blank_run - 1;
+            abs_time_step += blank_run - 1;
+            continue;
+        }
+
+        // same cutoff as DecoderState
+        const size_t beam = s.beam_entries.size();
+        float best_score = -NUM_FLT_INF;
+        for (size_t i = 0; i < beam; ++i)
+        {
+            best_score = max(best_score, s.beam_score[i]);
+        }
+        const float min_cutoff = best_score + pruned.max_log_prob(time_step) - options.beam_threshold;
+        const bool no_cutoff = min_cutoff == -numeric_limits<float>::infinity();
+
+        // the candidates of the next beam start out as the current beam
+        s.cand_entries.clear();
+        s.cand_tokens.clear();
+        s.cand_b.clear();
+        s.cand_nb.clear();
+        for (size_t i = 0; i < beam; ++i)
+        {
+            add_candidate(s.beam_entries[i]);
+        }
+
+        // loop over chars
+        for (size_t index = pruned.offsets[time_step]; index < pruned.offsets[time_step + 1]; index++)
+        {
+            const size_t c = pruned.indices[index];
+            const int token = pruned.indices[index];
+            const float log_prob_c = pruned.log_probs[index];
+            if (log_prob_c + best_score < min_cutoff)
+            {
+                continue;
+            }
+
+            // blank
+            if (c == options.blank_id)
+            {
+                if (no_cutoff)
+                {
+                    log_sum_exp_n(s.cand_b.data(), s.beam_score.data(), log_prob_c, beam, log_add);
+                    continue;
+                }
+                for (size_t i = 0; i < beam; ++i)
+                {
+                    if (log_prob_c + s.beam_score[i] >= min_cutoff)
+                    {
+                        s.cand_b[i] = log_add(s.cand_b[i], log_prob_c + s.beam_score[i]);
+                    }
+                }
+                continue;
+            }
+
+            for (size_t i = 0; i < beam; ++i)
+            {
+                if (log_prob_c + s.beam_score[i] < min_cutoff)
+                {
+                    continue;
+                }
+
+                // repeated character
+                if (token == s.beam_tokens[i])
+                {
+                    s.cand_nb[i] = log_add(s.cand_nb[i], log_prob_c + s.beam_nb[i]);
+                }
+
+                // get new prefix, merging with the one extended from the same parent, if any
+                int child = find(s.beam_entries[i], token);
+                int slot;
+                if (child >= 0)
+                {
+                    if (s.log_probs_c[child] < log_prob_c)
+                    {
+                        s.log_probs_c[child] = log_prob_c;
+                        s.timesteps[child] = abs_time_step;
+                    }
+                    slot = s.slots[child];
+                    if (slot < 0)
+                    {
+                        ++s.refs[child];
+                        slot = add_candidate(child);
+                    }
+                }
+                else
+                {
+                    // same as the lexicon check of PathTrie::get_path_trie
+                    int lexicon_state = 0;
+                    if (lexicon != nullptr)
+                    {
+                        lexicon_state = lexicon->next(s.lexicon_states[s.beam_entries[i]], token);
+                        if (lexicon_state == fst::kNoStateId)
+                            continue;
+                    }
+                    child = add_entry(s.beam_entries[i], token, abs_time_step, log_prob_c, lexicon_state);
+                    if (language_model != nullptr)
+                    {
+                        s.lm_scores[child]
+                            = language_model->next(s.lm_states[s.beam_entries[i]], token, s.lm_states[child]);
+                    }
+                    slot = add_candidate(child);
+                }
+
+                float log_p = -NUM_FLT_INF;
+                if (token == s.beam_tokens[i] && s.beam_b[i] > -NUM_FLT_INF)
+                {
+                    log_p = log_prob_c + s.beam_b[i] + s.lm_scores[child];
+                }
+                else if (token != s.beam_tokens[i])
+                {
+                    log_p = log_prob_c + s.beam_score[i] + s.lm_scores[child];
+                }
+                s.cand_nb[slot] = log_add(s.cand_nb[slot], log_p);
+            }  // end of loop over prefix
+        }  // end of loop over vocabulary
+
+        // update log probs
+        const size_t num_candidates = s.cand_entries.size();
+        s.cand_score.resize(num_candidates);
+        for (size_t i = 0; i < num_candidates; ++i)
+        {
+            s.cand_score[i] = log_add(s.cand_b[i], s.cand_nb[i]);
+        }
+        for (size_t i = 0; i < num_candidates; ++i)
+        {
+            s.slots[s.cand_entries[i]] = -1;
+        }
+
+        // drop the candidates that fell more than beam_threshold behind the best one, keeping the others in order.
+        // The best one always stays, the beam can't be empty.
+        best_score = -NUM_FLT_INF;
+        size_t best = 0;
+        for (size_t i = 0; i < num_candidates; ++i)
+        {
+            if (s.cand_score[i] > best_score)
+            {
+                best_score = s.cand_score[i];
+                best = i;
+            }
+        }
+        s.order.clear();
+        for (size_t i = 0; i < num_candidates; ++i)
+        {
+            if (i != best && s.cand_score[i] < best_score - options.beam_threshold)
+            {
+                release_entry(s.cand_entries[i]);
+            }
+            else
+            {
+                s.order.push_back(static_cast<int>(i));
+            }
+        }
+
+        // only preserve top beam_size prefixes
+        size_t num_kept = s.order.size();
+        if (num_kept >= options.beam_size)
+        {
+            nth_element(
+                s.order.begin(),
+                s.order.begin() + options.beam_size,
+                s.order.end(),
+                candidate_compare { s.cand_score, s.cand_tokens });
+            for (size_t i = options.beam_size; i < s.order.size(); ++i)
+            {
+                release_entry(s.cand_entries[s.order[i]]);
+            }
+            num_kept = options.beam_size;
+        }
+
+        s.beam_entries.resize(num_kept);
+        s.beam_tokens.resize(num_kept);
+        s.beam_b.resize(num_kept);
+        s.beam_nb.resize(num_kept);
+        s.beam_score.resize(num_kept);
+        for (size_t i = 0; i < num_kept; ++i)
+        {
+            const int j = s.order[i];
+            s.beam_entries[i] = s.cand_entries[j];
+            s.beam_tokens[i] = s.cand_tokens[j];
+            s.beam_b[i] = s.cand_b[j];
+            s.beam_nb[i] = s.cand_nb[j];
+            s.beam_score[i] = s.cand_score[j];
+        }
+    }  // end of loop over time
+}
+
+vector<Output> HashedDecoderState::decode() const
+{
+    vector<Output> outputs = decode_uncommitted();
+    if (!committed_tokens.empty())
+    {
+        for (auto& output : outputs)
+        {
+            output.tokens.insert(output.tokens.begin(), committed_tokens.begin(), committed_tokens.end());
+            output.timesteps.insert(output.timesteps.begin(), committed_timesteps.begin(), committed_timesteps.end());
+        }
+    }
+    return outputs;
+}
+
+vector<int> HashedDecoderState::sorted_beam() const
+{
+    const auto& s = *storage;
+    vector<int> order(s.beam_entries.size());
+    iota(order.begin(), order.end(), 0);
+
+    // sorted twice, like DecoderState::sorted_prefixes, so that ties come out in the same order
+    order.resize(min(order.size(), options.beam_size));
+    candidate_compare compare { s.beam_score, s.beam_tokens };
+    sort(order.begin(), order.end(), compare);
+    sort(order.begin(), order.end(), compare);
+    return order;
+}
+
+vector<Output> HashedDecoderState::decode_uncommitted() const
+{
+    const auto& s = *storage;
+    const vector<int> order = sorted_beam();
+    vector<Output> output_vecs;
+    output_vecs.reserve(order.size());
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+        vector<int> tokens;
+        vector<int> timesteps;
+        for (int entry = s.beam_entries[order[i]]; entry != root_entry; entry = s.parents[entry])
+        {
+            tokens.push_back(s.tokens[entry]);
+            timesteps.push_back(s.timesteps[entry]);
+        }
+        reverse(tokens.begin(), tokens.end());
+        reverse(timesteps.begin(), timesteps.end());
+        output_vecs.emplace_back(-s.beam_score[order[i]], tokens, timesteps);
+    }
+    return output_vecs;
+}
+
+vector<Output> HashedDecoderState::decode_best(size_t num_results, bool uncommitted_only) const
+{
+    // same as DecoderState
+    const auto& s = *storage;
+    vector<int> best;
+    if (num_results == 1)
+        best.push_back(best_index);
+    else
+    {
+        best.resize(s.beam_entries.size());
+        iota(best.begin(), best.end(), 0);
+        num_results = min(num_results, best.size());
+        partial_sort(
+            best.begin(), best.begin() + num_results, best.end(), candidate_compare { s.beam_score, s.beam_tokens });
+        best.resize(num_results);
+    }
+
+    vector<Output> outputs;
+    outputs.reserve(best.size());
+    for (int i : best)
+    {
+        vector<int> tokens;
+        vector<int> timesteps;
+        for (int entry = s.beam_entries[i]; entry != root_entry; entry = s.parents[entry])
+        {
+            tokens.push_back(s.tokens[entry]);
+            timesteps.push_back(s.timesteps[entry]);
+        }
+        reverse(tokens.begin(), tokens.end());
+        reverse(timesteps.begin(), timesteps.end());
+        if (!uncommitted_only)
+        {
+            tokens.insert(tokens.begin(), committed_tokens.begin(), committed_tokens.end());
+            timesteps.insert(timesteps.begin(), committed_timesteps.begin(), committed_timesteps.end());
+        }
+        outputs.emplace_back(-s.beam_score[i], tokens, timesteps);
+    }
+    return outputs;
+}
+
+Lattice HashedDecoderState::decode_lattice() const
+{
+    // same as DecoderState
+    const auto& s = *storage;
+    const vector<int> order = sorted_beam();
+    const size_t num_candidates = order.size();
+
+    Lattice lattice;
+    const float best_log_prob = num_candidates == 0 ? -NUM_FLT_INF : s.beam_score[order[0]];
+    int trunk = -1;
+    for (size_t i = 0; i < committed_tokens.size(); ++i)
+    {
+        trunk = lattice.add_node(committed_tokens[i], committed_timesteps[i], trunk, best_log_prob);
+    }
+
+    // lattice node of every entry, -2 until it gets one
+    vector<int> nodes(s.tokens.size(), -2);
+    nodes[root_entry] = trunk;
+    vector<int> path;
+    for (size_t i = 0; i < num_candidates; ++i)
+    {
+        const float log_prob = s.beam_score[order[i]];
+        path.clear();
+        int entry = s.beam_entries[order[i]];
+        while (nodes[entry] == -2)
+        {
+            path.push_back(entry);
+            entry = s.parents[entry];
+        }
+
+        int parent = nodes[entry];
+        for (auto it = path.rbegin(); it != path.rend(); ++it)
+        {
+            parent = lattice.add_node(s.tokens[*it], s.timesteps[*it], parent, log_prob);
+            nodes[*it] = parent;
+        }
+        lattice.candidates.push_back(parent);
+        lattice.candidate_log_probs.push_back(log_prob);
+    }
+    return lattice;
+}
+
+string HashedDecoderState::snapshot() const
+{
+    const auto& s = *storage;
+    SnapshotWriter writer;
+    write_snapshot_header(writer, SnapshotKind::hashed_state, options);
+    writer.write<int32_t>(abs_time_step);
+    writer.write_vector(committed_tokens);
+    writer.write_vector(committed_timesteps);
+
+    // recycled entries are left out, the others are numbered after their parent, which restore checks, and otherwise
+    // keep their order. Ids don't matter to the search: the table finds an entry whatever its id, and candidates are
+    // ordered by score and token.
+    vector<int> numbers(s.tokens.size(), -1);
+    vector<bool> recycled(s.tokens.size(), false);
+    for (int entry : s.free_entries)
+    {
+        recycled[entry] = true;
+    }
+    vector<int> order, ancestors;
+    order.reserve(s.tokens.size() - s.free_entries.size());
+    for (int entry = 0; entry < static_cast<int>(s.tokens.size()); ++entry)
+    {
+        // number the ancestors that aren't yet, root first
+        for (int ancestor = entry; ancestor >= 0 && !recycled[ancestor] && numbers[ancestor] < 0;
+             ancestor = s.parents[ancestor])
+        {
+            ancestors.push_back(ancestor);
+        }
+        for (; !ancestors.empty(); ancestors.pop_back())
+        {
+            numbers[ancestors.back()] = static_cast<int>(order.size());
+            order.push_back(ancestors.back());
+        }
+    }
+
+    vector<int> tokens, timesteps, parents, refs, lexicon_states;
+    vector<float> log_probs_c, lm_scores;
+    vector<LanguageModelState> lm_states;
+    for (int entry : order)
+    {
+        tokens.push_back(s.tokens[entry]);
+        timesteps.push_back(s.timesteps[entry]);
+        parents.push_back(s.parents[entry] < 0 ? -1 : numbers[s.parents[entry]]);
+        refs.push_back(s.refs[entry]);
+        log_probs_c.push_back(s.log_probs_c[entry]);
+        lexicon_states.push_back(s.lexicon_states[entry]);
+        lm_states.push_back(s.lm_states[entry]);
+        lm_scores.push_back(s.lm_scores[entry]);
+    }
+    vector<int> beam_entries;
+    beam_entries.reserve(s.beam_entries.size());
+    for (int entry : s.beam_entries)
+    {
+        beam_entries.push_back(numbers[entry]);
+    }
+
+    writer.write_vector(tokens);
+    writer.write_vector(timesteps);
+    writer.write_vector(parents);
+    writer.write_vector(refs);
+    writer.write_vector(log_probs_c);
+    writer.write_vector(lexicon_states);
+    writer.write_vector(lm_states);
+    writer.write_vector(lm_scores);
+    writer.write<int32_t>(numbers[root_entry]);
+    writer.write_vector(beam_entries);
+    writer.write_vector(s.beam_tokens);
+    writer.write_vector(s.beam_b);
+    writer.write_vector(s.beam_nb);
+    writer.write_vector(s.beam_score);
+    return writer.release();
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "decoder_options.h"
+#include "language_model.h"
+#include "log_probs_view.h"
+#include "output.h"
+
+struct DecoderWorkspace;
+struct PrunedLogProbs;
+
+/* Storage of the hashed-prefix beam search, kept in a DecoderWorkspace so that
+ * its capacity carries over between utterances.
+ *
+ * A prefix is an entry of the history arrays: its last token, the entry of its
+ * parent prefix, and the timestep and log probability of that token. Entries
+ * are reference counted by their children and by the beam, and are recycled
+ * once nothing refers to them. An open-addressing table maps (parent, token)
+ * to the entry, which is how extensions of different prefixes are merged.
+ */
+struct HashedBeamStorage
+{
+    // history, one entry per referenced prefix, back to the prefix the beam agrees on
+    std::vector<int> tokens;
+    std::vector<int> timesteps;
+    std::vector<int> parents;
+    std::vector<int> refs;
+    std::vector<float> log_probs_c;
+    // state of the prefix in the lexicon of the options, 0 without one
+    std::vector<int> lexicon_states;
+    // state of the prefix in the language model of the options, and the weighted score of its last token
+    std::vector<LanguageModelState> lm_states;
+    std::vector<float> lm_scores;
+    std::vector<int> free_entries;
+    // candidate index of every entry during a time step, -1 if it isn't one
+    std::vector<int> slots;
+
+    // linear probing table of entries keyed by (parent, token), -1 marks an empty bucket
+    std::vector<int> table;
+    size_t num_entries = 0;
+
+    // beam and candidates of the next beam, as structure of arrays
+    std::vector<int> beam_entries, beam_tokens;
+    std::vector<float> beam_b, beam_nb, beam_score;
+    std::vector<int> cand_entries, cand_tokens;
+    std::vector<float> cand_b, cand_nb, cand_score;
+    std::vector<int> order;
+    // entries from the root to a prefix of the beam
+    std::vector<int> path;
+
+    void clear();
+};
+
+/* Beam search with the beam held in flat arrays instead of a PathTrie. It gives
+ * the same tokens, timesteps and scores as DecoderState, with predictable
+ * memory access, which pays off for large beams and vocabularies.
+ */
+class HashedDecoderState
+{
+    int abs_time_step;
+    DecoderOptions options;
+
+    std::unique_ptr<DecoderWorkspace> own_workspace;
+    DecoderWorkspace* workspace;
+    HashedBeamStorage* storage;
+    int root_entry;
+    // index in the beam of its first prefix in the order of decode(), kept up to date by next()
+    int best_index;
+    std::vector<int> committed_tokens, committed_timesteps;
+
+    int find(int parent, int token) const;
+    int find_best() const;
+    int add_entry(int parent, int token, int timestep, float log_prob_c, int lexicon_state);
+    void release_entry(int entry);
+    void insert_into_table(int entry);
+    void erase_from_table(int entry);
+    size_t home_bucket(int parent, int token) const;
+    void drop_stale_prefixes();
+    // indices in the beam of the prefixes of decode(), best first
+    std::vector<int> sorted_beam() const;
+    void commit_stable_prefix();
+
+    template <typename LogAdd>
+    void expand(const PrunedLogProbs& pruned, LogAdd log_add);
+
+public:
+    /* Parameters:
+     *     options: Settings of the beam search, options.engine is ignored.
+     *     workspace: Buffers to borrow for the lifetime of the state, a private
+     *                one is allocated if it is null or already in use.
+     */
+    HashedDecoderState(const DecoderOptions& options, DecoderWorkspace* workspace = nullptr);
+
+    // Same as the DecoderState constructor restoring a snapshot
+    HashedDecoderState(const std::string& snapshot, DecoderWorkspace* workspace = nullptr);
+    HashedDecoderState(const HashedDecoderState&) = delete;
+    HashedDecoderState& operator=(const HashedDecoderState&) = delete;
+    ~HashedDecoderState();
+
+    // Same as DecoderState::next
+    void next(const LogProbsView& probs_seq);
+    void next(const PrunedLogProbs& pruned);
+
+    // Same as DecoderState::decode
+    std::vector<Output> decode() const;
+
+    // Same as the DecoderState methods of the same name
+    std::vector<Output> decode_uncommitted() const;
+    std::vector<Output> decode_best(size_t num_results, bool uncommitted_only = false) const;
+
+    // Same as DecoderState::decode_lattice
+    Lattice decode_lattice() const;
+
+    // Same as DecoderState::snapshot, with the entries of the history still referenced, renumbered from 0
+    std::string snapshot() const;
+
+    const std::vector<int>& get_committed_tokens() const
+    {
+        return committed_tokens;
+    }
+
+    const std::vector<int>& get_committed_timesteps() const
+    {
+        return committed_timesteps;
+    }
+};
@@ -0,0 +1,720 @@
+#include "language_model.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+
+#include "fst/mapped-file.h"
+
+using namespace std;
+
+namespace
+{
+const uint32_t MODEL_MAGIC = 0x4d4c5443;  // "CTLM" in little endian
+const uint32_t MODEL_VERSION = 1;
+const uint32_t NOT_FOUND = UINT32_MAX;
+// ARPA files hold log10 probabilities
+const float LOG10_TO_LN = 2.302585093f;
+// log10 probability of the words an ARPA file doesn't have, as KenLM does
+const float MISSING_WORD_LOG10_PROB = -100.0f;
+
+atomic<uint64_t> next_model_id { 1 };
+
+mutex loaded_models_mutex;
+// models by path, and language models by path, labels and separator, for as long as something still holds them
+unordered_map<string, weak_ptr<const NGramModel>> loaded_ngram_models;
+unordered_map<string, weak_ptr<const LanguageModel>> loaded_language_models;
+
+// index of word in words[begin, end), which is sorted, or NOT_FOUND
+uint32_t find_sorted(const uint32_t* words, uint32_t begin, uint32_t end, uint32_t word)
+{
+    const uint32_t* it = lower_bound(words + begin, words + end, word);
+    if (it == words + end || *it != word)
+        return NOT_FOUND;
+    return static_cast<uint32_t>(it - words);
+}
+
+// appends arrays to the binary image, each one 8-byte aligned
+class ImageWriter
+{
+    vector<char> data;
+
+public:
+    template <typename T>
+    void write(const T* values, size_t count)
+    {
+        const char* bytes = reinterpret_cast<const char*>(values);
+        data.insert(data.end(), bytes, bytes + count * sizeof(T));
+        data.resize((data.size() + 7) / 8 * 8, 0);
+    }
+
+    template <typename T>
+    void write(const vector<T>& values)
+    {
+        write(values.data(), values.size());
+    }
+
+    template <typename T>
+    void write_value(T value)
+    {
+        write(&value, 1);
+    }
+
+    // the image, in words so that it is 8-byte aligned in memory as well
+    vector<uint64_t> release()
+    {
+        vector<uint64_t> image(data.size() / 8);
+        if (!data.empty())
+            memcpy(image.data(), data.data(), data.size());
+        return image;
+    }
+};
+
+// reads the arrays written by ImageWriter, checking that they are within the image
+class ImageReader
+{
+    const char* pos;
+    const char* end;
+
+public:
+    ImageReader(const char* data, size_t size)
+        : pos(data)
+        , end(data + size)
+    {}
+
+    template <typename T>
+    const T* read(uint64_t count)
+    {
+        uint64_t size = (count * sizeof(T) + 7) / 8 * 8;
+        if (count > static_cast<uint64_t>(end - pos) / sizeof(T) || size > static_cast<uint64_t>(end - pos))
+            throw invalid_argument("truncated language model");
+        const T* values = reinterpret_cast<const T*>(pos);
+        pos += size;
+        return values;
+    }
+
+    template <typename T>
+    T read_value()
+    {
+        return *read<T>(1);
+    }
+};
+
+// n-grams of one order of an ARPA file, before they are sorted into the model
+struct ArpaOrder
+{
+    vector<uint32_t> words;
+    vector<float> log_probs;
+    vector<float> backoffs;
+};
+
+// the same arrays as NGramModel::Order, owned
+struct BuiltOrder
+{
+    vector<uint32_t> words;
+    vector<float> log_probs;
+    vector<float> backoffs;
+    vector<uint32_t> first_children;
+    vector<uint32_t> suffixes;
+};
+
+// local index of the n-gram words[0, num_words) in its order, or NOT_FOUND
+uint32_t find_ngram(const vector<BuiltOrder>& orders, const uint32_t* words, size_t num_words)
+{
+    uint32_t entry = words[0];
+    for (size_t k = 1; k < num_words && entry != NOT_FOUND; ++k)
+    {
+        const auto& first_children = orders[k - 1].first_children;
+        entry = find_sorted(orders[k].words.data(), first_children[entry], first_children[entry + 1], words[k]);
+    }
+    return entry;
+}
+
+string trim(const string& line)
+{
+    size_t begin = line.find_first_not_of(" \t\r");
+    if (begin == string::npos)
+        return string();
+    return line.substr(begin, line.find_last_not_of(" \t\r") + 1 - begin);
+}
+
+// false unless text is a decimal number that fits count, give or take spaces
+bool parse_count(const string& text, uint64_t& count)
+{
+    const string digits = trim(text);
+    if (digits.empty() || digits.find_first_not_of("0123456789") != string::npos)
+        return false;
+    errno = 0;
+    count = strtoull(digits.c_str(), nullptr, 10);
+    return errno != ERANGE;
+}
+}
+
+NGramModel::NGramModel(const string& path)
+    : path_(path)
+    , id_(next_model_id++)
+{
+    ifstream stream(path, ios_base::in | ios_base::binary);
+    if (!stream)
+        throw invalid_argument("can't open language model " + path);
+
+    uint32_t magic = 0;
+    stream.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+    stream.clear();
+    stream.seekg(0, ios_base::end);
+    size_t size = static_cast<size_t>(stream.tellg());
+    stream.seekg(0);
+    if (magic == MODEL_MAGIC)
+        map_binary(stream, size);
+    else
+        read_arpa(stream);
+}
+
+NGramModel::~NGramModel() = default;
+
+shared_ptr<const NGramModel> NGramModel::load(const string& path)
+{
+    lock_guard<mutex> lock(loaded_models_mutex);
+    auto& loaded = loaded_ngram_models[path];
+    shared_ptr<const NGramModel> model = loaded.lock();
+    if (model == nullptr)
+    {
+        model.reset(new NGramModel(path));
+        loaded = model;
+    }
+    return model;
+}
+
+void NGramModel::map_binary(istream& stream, size_t size)
+{
+    // mapped rather than read, the pages are shared with every other process using the file
+    mapped_.reset(fst::MappedFile::Map(stream, true, path_, size));
+    if (mapped_ == nullptr)
+        throw invalid_argument("can't read language model " + path_);
+    attach(static_cast<const char*>(mapped_->data()), size);
+}
+
+void NGramModel::read_arpa(istream& stream)
+{
+    string line;
+    size_t line_number = 0;
+    while (getline(stream, line))
+    {
+        ++line_number;
+        if (trim(line) == "\\data\\")
+            break;
+    }
+    if (!stream)
+        throw invalid_argument(path_ + " is neither an ARPA file nor a binary language model");
+
+    vector<uint64_t> counts;
+    vector<ArpaOrder> arpa;
+    vector<string> vocabulary;
+    unordered_map<string, uint32_t> indices;
+    size_t section = 0;
+    auto error = [&](const string& message) {
+        return invalid_argument(path_ + ":" + to_string(line_number) + ": " + message);
+    };
+
+    vector<string> fields;
+    bool ended = false;
+    while (!ended && getline(stream, line))
+    {
+        ++line_number;
+        line = trim(line);
+        if (line.empty())
+            continue;
+
+        if (line == "\\end\\")
+        {
+            ended = true;
+        }
+        else if (section == 0 && line.compare(0, 6, "ngram ") == 0)
+        {
+            size_t equals = line.find('=');
+            uint64_t order = 0;
+            uint64_t count = 0;
+            if (equals == string::npos || !parse_count(line.substr(6, equals - 6), order) || order != counts.size() + 1)
+                throw error("expected the count of the " + to_string(counts.size() + 1) + "-grams");
+            if (!parse_count(line.substr(equals + 1), count))
+                throw error("bad n-gram count " + trim(line.substr(equals + 1)));
+            counts.push_back(count);
+        }
+        else if (line[0] == '\\')
+        {
+            if (line != "\\" + to_string(section + 1) + "-grams:" || section >= counts.size())
+                throw error("unexpected section " + line);
+            if (section > 0 && arpa[section - 1].log_probs.size() != counts[section - 1])
+                throw error("the number of " + to_string(section) + "-grams doesn't match the header");
+            ++section;
+            arpa.emplace_back();
+        }
+        else
+        {
+            if (section == 0)
+                throw error("n-gram outside of a section");
+
+            fields.clear();
+            istringstream words(line);
+            for (string field; words >> field;)
+            {
+                fields.push_back(field);
+            }
+            if (fields.size() != section + 1 && fields.size() != section + 2)
+                throw error("expected a log probability, " + to_string(section) + " words and a back-off weight");
+
+            auto& order = arpa[section - 1];
+            char* parsed;
+            order.log_probs.push_back(strtof(fields[0].c_str(), &parsed) * LOG10_TO_LN);
+            if (*parsed != '\0')
+                throw error("bad log probability " + fields[0]);
+            float backoff = 0.0f;
+            if (fields.size() == section + 2)
+            {
+                backoff = strtof(fields.back().c_str(), &parsed) * LOG10_TO_LN;
+                if (*parsed != '\0')
+                    throw error("bad back-off weight " + fields.back());
+            }
+            order.backoffs.push_back(backoff);
+
+            for (size_t k = 1; k <= section; ++k)
+            {
+                if (section == 1)
+                {
+                    if (!indices.emplace(fields[k], static_cast<uint32_t>(vocabulary.size())).second)
+                        throw error("duplicate unigram " + fields[k]);
+                    vocabulary.push_back(fields[k]);
+                    continue;
+                }
+                auto index = indices.find(fields[k]);
+                if (index == indices.end())
+                    throw error("word " + fields[k] + " isn't a unigram");
+                order.words.push_back(index->second);
+            }
+        }
+    }
+    if (!ended || counts.empty() || section != counts.size() || arpa.back().log_probs.size() != counts.back())
+        throw invalid_argument(path_ + " is a truncated ARPA file");
+
+    // the words every model needs, with the probability KenLM gives them when they are missing
+    for (const char* word : { "<unk>", "<s>", "</s>" })
+    {
+        if (indices.emplace(word, static_cast<uint32_t>(vocabulary.size())).second)
+        {
+            vocabulary.push_back(word);
+            arpa[0].log_probs.push_back(MISSING_WORD_LOG10_PROB * LOG10_TO_LN);
+            arpa[0].backoffs.push_back(0.0f);
+        }
+    }
+
+    // sort every order by context and word, which also gives the continuations of the order below
+    const size_t num_orders = counts.size();
+    vector<BuiltOrder> built(num_orders);
+    built[0].log_probs = move(arpa[0].log_probs);
+    built[0].backoffs = move(arpa[0].backoffs);
+    for (size_t k = 1; k < num_orders; ++k)
+    {
+        const auto& raw = arpa[k];
+        const size_t num_ngrams = raw.log_probs.size();
+        vector<uint32_t> parents(num_ngrams), suffixes(num_ngrams);
+        for (size_t i = 0; i < num_ngrams; ++i)
+        {
+            const uint32_t* words = &raw.words[i * (k + 1)];
+            parents[i] = find_ngram(built, words, k);
+            if (parents[i] == NOT_FOUND)
+                throw invalid_argument(path_ + " has a " + to_string(k + 1) + "-gram without its prefix");
+
+            // the longest suffix the model has, unigrams at least
+            for (size_t s = 1; s <= k; ++s)
+            {
+                uint32_t suffix = find_ngram(built, words + s, k + 1 - s);
+                if (suffix != NOT_FOUND)
+                {
+                    uint32_t suffix_first_entry = 0;
+                    for (size_t j = 0; j < k - s; ++j)
+                    {
+                        suffix_first_entry += static_cast<uint32_t>(built[j].log_probs.size());
+                    }
+                    suffixes[i] = suffix_first_entry + suffix;
+                    break;
+                }
+            }
+        }
+
+        vector<uint32_t> sorted(num_ngrams);
+        iota(sorted.begin(), sorted.end(), 0);
+        auto last_word = [&](uint32_t i) { return raw.words[i * (k + 1) + k]; };
+        sort(sorted.begin(), sorted.end(), [&](uint32_t x, uint32_t y) {
+            return parents[x] != parents[y] ? parents[x] < parents[y] : last_word(x) < last_word(y);
+        });
+
+        auto& order = built[k];
+        auto& first_children = built[k - 1].first_children;
+        first_children.assign(built[k - 1].log_probs.size() + 1, 0);
+        for (size_t n = 0; n < num_ngrams; ++n)
+        {
+            uint32_t i = sorted[n];
+            if (n > 0 && parents[i] == parents[sorted[n - 1]] && last_word(i) == last_word(sorted[n - 1]))
+                throw invalid_argument(path_ + " has a duplicate " + to_string(k + 1) + "-gram");
+            order.words.push_back(last_word(i));
+            order.log_probs.push_back(raw.log_probs[i]);
+            order.backoffs.push_back(raw.backoffs[i]);
+            order.suffixes.push_back(suffixes[i]);
+            ++first_children[parents[i] + 1];
+        }
+        partial_sum(first_children.begin(), first_children.end(), first_children.begin());
+    }
+
+    ImageWriter writer;
+    writer.write_value(MODEL_MAGIC);
+    writer.write_value(MODEL_VERSION);
+    writer.write_value<uint64_t>(num_orders);
+    writer.write_value<uint64_t>(vocabulary.size());
+    writer.write_value<uint64_t>(indices["<unk>"]);
+    writer.write_value<uint64_t>(indices["<s>"]);
+    for (const auto& order : built)
+    {
+        writer.write_value<uint64_t>(order.log_probs.size());
+    }
+    vector<uint64_t> word_offsets(1, 0);
+    string word_chars;
+    for (const auto& word : vocabulary)
+    {
+        word_chars += word;
+        word_offsets.push_back(word_chars.size());
+    }
+    writer.write(word_offsets);
+    writer.write(word_chars.data(), word_chars.size());
+    for (size_t k = 0; k < num_orders; ++k)
+    {
+        const auto& order = built[k];
+        if (k > 0)
+            writer.write(order.words);
+        writer.write(order.log_probs);
+        if (k + 1 < num_orders)
+        {
+            writer.write(order.backoffs);
+            writer.write(order.first_children);
+        }
+        if (k > 0)
+            writer.write(order.suffixes);
+    }
+
+    owned_ = writer.release();
+    attach(reinterpret_cast<const char*>(owned_.data()), owned_.size() * sizeof(uint64_t));
+}
+
+void NGramModel::attach(const char* data, size_t size)
+{
+    data_ = data;
+    size_ = size;
+    ImageReader reader(data, size);
+    if (reader.read_value<uint32_t>() != MODEL_MAGIC)
+        throw invalid_argument(path_ + " isn't a binary language model, or written on a host of another byte order");
+    if (reader.read_value<uint32_t>() != MODEL_VERSION)
+        throw invalid_argument(path_ + " is a binary language model of another version of the library");
+    order_ = reader.read_value<uint64_t>();
+    vocabulary_size_ = reader.read_value<uint64_t>();
+    unknown_word_ = static_cast<uint32_t>(reader.read_value<uint64_t>());
+    start_state_ = static_cast<uint32_t>(reader.read_value<uint64_t>());
+    if (order_ == 0 || unknown_word_ >= vocabulary_size_ || start_state_ >= vocabulary_size_)
+        throw invalid_argument("corrupt language model " + path_);
+
+    vector<uint64_t> counts(order_);
+    uint64_t num_entries = 0;
+    for (auto& count : counts)
+    {
+        count = reader.read_value<uint64_t>();
+        num_entries += count;
+    }
+    if (counts[0] != vocabulary_size_ || num_entries >= NOT_FOUND)
+        throw invalid_argument("corrupt language model " + path_);
+
+    word_offsets_ = reader.read<uint64_t>(vocabulary_size_ + 1);
+    word_chars_ = reader.read<char>(word_offsets_[vocabulary_size_]);
+    word_indices_.clear();
+    word_indices_.reserve(vocabulary_size_);
+    for (size_t i = 0; i < vocabulary_size_; ++i)
+    {
+        if (word_offsets_[i] > word_offsets_[i + 1] || word_offsets_[i + 1] > word_offsets_[vocabulary_size_])
+            throw invalid_argument("corrupt language model " + path_);
+        word_indices_.emplace(get_word(static_cast<uint32_t>(i)), static_cast<uint32_t>(i));
+    }
+
+    orders_.assign(order_, Order {});
+    uint32_t first_entry = 0;
+    for (size_t k = 0; k < order_; ++k)
+    {
+        auto& order = orders_[k];
+        order.first_entry = first_entry;
+        order.num_entries = static_cast<uint32_t>(counts[k]);
+        first_entry += order.num_entries;
+        if (k > 0)
+            order.words = reader.read<uint32_t>(counts[k]);
+        order.log_probs = reader.read<float>(counts[k]);
+        if (k + 1 < order_)
+        {
+            order.backoffs = reader.read<float>(counts[k]);
+            order.first_children = reader.read<uint32_t>(counts[k] + 1);
+            if (order.first_children[counts[k]] != counts[k + 1])
+                throw invalid_argument("corrupt language model " + path_);
+        }
+        if (k > 0)
+            order.suffixes = reader.read<uint32_t>(counts[k]);
+    }
+
+    // score() follows these as they are, so a corrupt file mustn't send it out of the arrays or around in circles
+    for (size_t k = 0; k < order_; ++k)
+    {
+        const Order& order = orders_[k];
+        for (uint32_t i = 0; i < order.num_entries; ++i)
+        {
+            bool valid = k == 0 || (order.words[i] < vocabulary_size_ && order.suffixes[i] < order.first_entry);
+            if (k + 1 < order_)
+                valid = valid && order.first_children[i] <= order.first_children[i + 1];
+            if (!valid)
+                throw invalid_argument("corrupt language model " + path_);
+        }
+        if (k + 1 < order_ && order.first_children[0] != 0)
+            throw invalid_argument("corrupt language model " + path_);
+    }
+}
+
+void NGramModel::save(const string& path) const
+{
+    ofstream stream(path, ios_base::out | ios_base::binary);
+    stream.write(data_, size_);
+    if (!stream)
+        throw runtime_error("can't write language model " + path);
+}
+
+float NGramModel::score(uint32_t state, uint32_t word, uint32_t& next_state) const
+{
+    float backoff = 0.0f;
+    uint32_t context = state;
+    while (context != NO_CONTEXT)
+    {
+        // entries are numbered by order, and there are only a few orders
+        size_t k = order_ - 1;
+        while (context < orders_[k].first_entry)
+        {
+            --k;
+        }
+        const Order& order = orders_[k];
+        const uint32_t i = context - order.first_entry;
+
+        if (k + 1 < order_)
+        {
+            const Order& next = orders_[k + 1];
+            uint32_t child = find_sorted(next.words, order.first_children[i], order.first_children[i + 1], word);
+            if (child != NOT_FOUND)
+            {
+                next_state = next.first_entry + child;
+                return backoff + next.log_probs[child];
+            }
+            backoff += order.backoffs[i];
+        }
+        context = k > 0 ? order.suffixes[i] : NO_CONTEXT;
+    }
+    next_state = word;
+    return backoff + orders_[0].log_probs[word];
+}
+
+uint32_t NGramModel::find_word(const string& word) const
+{
+    auto index = word_indices_.find(word);
+    return index != word_indices_.end() ? index->second : unknown_word_;
+}
+
+string NGramModel::get_word(uint32_t word) const
+{
+    return string(word_chars_ + word_offsets_[word], word_offsets_[word + 1] - word_offsets_[word]);
+}
+
+LanguageModel::LanguageModel(const string& path, const vector<string>& labels, int separator_id)
+    : ngrams_(NGramModel::load(path))
+    , labels_(labels)
+    , separator_id_(separator_id)
+{
+    if (separator_id >= static_cast<int>(labels.size()))
+        throw invalid_argument("the separator of a language model must be one of its labels");
+
+    if (separator_id < 0)
+    {
+        for (const auto& label : labels)
+        {
+            token_words_.push_back(ngrams_->find_word(label));
+        }
+        return;
+    }
+
+    // spell every word with the longest labels that match it, words that can't be spelled are unknown
+    unordered_map<string, int> tokens;
+    size_t max_label_size = 0;
+    for (int token = 0; token < static_cast<int>(labels.size()); ++token)
+    {
+        if (token != separator_id && !labels[token].empty())
+        {
+            tokens.emplace(labels[token], token);
+            max_label_size = max(max_label_size, labels[token].size());
+        }
+    }
+    spelling_words_.push_back(NO_WORD);
+    vector<int> spelling;
+    for (uint32_t word = 0; word < ngrams_->get_vocabulary_size(); ++word)
+    {
+        const string text = ngrams_->get_word(word);
+        if (text == "<s>" || text == "</s>" || text == "<unk>")
+            continue;
+
+        spelling.clear();
+        for (size_t pos = 0; pos < text.size();)
+        {
+            size_t size = min(max_label_size, text.size() - pos);
+            auto token = tokens.end();
+            for (; size > 0; --size)
+            {
+                token = tokens.find(text.substr(pos, size));
+                if (token != tokens.end())
+                    break;
+            }
+            if (size == 0)
+            {
+                spelling.clear();
+                break;
+            }
+            spelling.push_back(token->second);
+            pos += size;
+        }
+        if (spelling.empty())
+            continue;
+
+        int32_t node = 0;
+        for (int token : spelling)
+        {
+            uint64_t key = (static_cast<uint64_t>(node) << 32) | static_cast<uint32_t>(token);
+            auto child = spelling_children_.emplace(key, static_cast<int32_t>(spelling_words_.size()));
+            if (child.second)
+                spelling_words_.push_back(NO_WORD);
+            node = child.first->second;
+        }
+        // the first word of the spelling keeps it
+        if (spelling_words_[node] == NO_WORD)
+            spelling_words_[node] = word;
+    }
+}
+
+shared_ptr<const LanguageModel> LanguageModel::load(const string& path, const vector<string>& labels, int separator_id)
+{
+    string key = path + '\0' + to_string(separator_id);
+    for (const auto& label : labels)
+    {
+        key += '\0' + label;
+    }
+
+    // the n-gram model is loaded by the constructor, under the lock of NGramModel::load
+    shared_ptr<const LanguageModel> language_model;
+    {
+        lock_guard<mutex> lock(loaded_models_mutex);
+        language_model = loaded_language_models[key].lock();
+    }
+    if (language_model == nullptr)
+    {
+        language_model.reset(new LanguageModel(path, labels, separator_id));
+        lock_guard<mutex> lock(loaded_models_mutex);
+        // another thread may have been quicker, share its copy
+        auto& loaded = loaded_language_models[key];
+        if (auto other = loaded.lock())
+            return other;
+        loaded = language_model;
+    }
+    return language_model;
+}
+
+int64_t LanguageModel::end_word(LanguageModelState state, int token, int32_t& spelling) const
+{
+    const bool known = token >= 0 && token < static_cast<int>(labels_.size());
+    if (separator_id_ < 0)
+    {
+        spelling = 0;
+        return known ? token_words_[token] : ngrams_->find_word("<unk>");
+    }
+
+    if (token != separator_id_)
+    {
+        spelling = UNKNOWN_SPELLING;
+        if (known && state.spelling != UNKNOWN_SPELLING)
+        {
+            auto child = spelling_children_.find((static_cast<uint64_t>(state.spelling) << 32) | token);
+            if (child != spelling_children_.end())
+                spelling = child->second;
+        }
+        return -1;
+    }
+
+    spelling = 0;
+    if (state.spelling == 0)
+        return -1;
+    if (state.spelling == UNKNOWN_SPELLING || spelling_words_[state.spelling] == NO_WORD)
+        return ngrams_->find_word("<unk>");
+    return spelling_words_[state.spelling];
+}
+
+bool LanguageModel::is_valid(LanguageModelState state) const
+{
+    if (state.context >= ngrams_->get_num_entries())
+        return false;
+    if (separator_id_ < 0)
+        return state.spelling == 0;
+    return state.spelling == UNKNOWN_SPELLING
+        || (state.spelling >= 0 && state.spelling < static_cast<int32_t>(spelling_words_.size()));
+}
+
+void LanguageModelScorer::bind(const shared_ptr<const LanguageModel>& language_model, float alpha, float beta)
+{
+    language_model_ = language_model;
+    alpha_ = alpha;
+    beta_ = beta;
+    model_id_ = language_model_ != nullptr ? language_model_->get_ngrams().get_id() : 0;
+}
+
+vector<LanguageModelScorer::CacheEntry>& LanguageModelScorer::cache_for_this_thread()
+{
+    // like DecoderWorkspace::for_this_thread, a worker of the pool always runs on the same thread
+    static thread_local vector<CacheEntry> cache;
+    return cache;
+}
+
+float LanguageModelScorer::next(LanguageModelState state, int token, LanguageModelState& next_state)
+{
+    int32_t spelling;
+    int64_t word = language_model_->end_word(state, token, spelling);
+    next_state.context = state.context;
+    next_state.spelling = spelling;
+    if (word < 0)
+        return 0.0f;
+
+    vector<CacheEntry>& cache = cache_for_this_thread();
+    if (cache.empty())
+        cache.assign(CACHE_SIZE, CacheEntry { 0, 0, 0, 0, 0.0f });
+    uint64_t key = (static_cast<uint64_t>(state.context) << 32) | static_cast<uint32_t>(word);
+    key = key * 0x9e3779b97f4a7c15ULL + model_id_ * 0xc2b2ae3d27d4eb4fULL;
+    CacheEntry& entry = cache[key >> (64 - CACHE_BITS)];
+    if (entry.model != model_id_ || entry.state != state.context || entry.word != word)
+    {
+        entry.model = model_id_;
+        entry.state = state.context;
+        entry.word = static_cast<uint32_t>(word);
+        entry.log_prob = language_model_->get_ngrams().score(state.context, entry.word, entry.next_state);
+    }
+    next_state.context = entry.next_state;
+    return alpha_ * entry.log_prob + beta_;
+}
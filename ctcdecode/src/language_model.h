@@ -0,0 +1,258 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace fst
+{
+class MappedFile;
+}
+
+/* Back-off n-gram model, as a trie of sorted arrays: the n-grams of an order
+ * are sorted by the entry of their context, i.e. their first n - 1 words, and
+ * then by their last word, so that the continuations of a context are a range
+ * found by binary search. Unigrams are indexed by word.
+ *
+ * Entries are numbered across orders, unigrams first, and the entry of an
+ * n-gram is also the state of a history ending with it: the longest suffix of
+ * the history that the model has. Probabilities and back-off weights are
+ * natural logarithms.
+ *
+ * The arrays live in one buffer laid out like the binary format, so that a
+ * binary model is memory mapped as it is, and an ARPA one is converted into
+ * the same buffer.
+ */
+class NGramModel
+{
+public:
+    // no history, before the unigrams
+    static constexpr uint32_t NO_CONTEXT = UINT32_MAX;
+
+    /* Load an ARPA file, or a binary one written by save(). A file already
+     * loaded and still in use is shared rather than loaded again. Throws
+     * std::invalid_argument if the file can't be read.
+     */
+    static std::shared_ptr<const NGramModel> load(const std::string& path);
+
+    NGramModel(const NGramModel&) = delete;
+    NGramModel& operator=(const NGramModel&) = delete;
+    ~NGramModel();
+
+    // write the model in the binary format, which loads without parsing and is memory mapped
+    void save(const std::string& path) const;
+
+    // log probability of word after the history of state, and the state of the history followed by word
+    float score(uint32_t state, uint32_t word, uint32_t& next_state) const;
+
+    size_t get_order() const
+    {
+        return order_;
+    }
+
+    size_t get_vocabulary_size() const
+    {
+        return vocabulary_size_;
+    }
+
+    // number of n-grams of all orders, i.e. of states
+    size_t get_num_entries() const
+    {
+        return orders_.back().first_entry + orders_.back().num_entries;
+    }
+
+    // index of word, or the one of <unk> if the model doesn't have it
+    uint32_t find_word(const std::string& word) const;
+
+    std::string get_word(uint32_t word) const;
+
+    // state of a history that only holds the start of a sentence
+    uint32_t get_start_state() const
+    {
+        return start_state_;
+    }
+
+    const std::string& get_path() const
+    {
+        return path_;
+    }
+
+    // unique among the models of the process, unlike addresses which are reused
+    uint64_t get_id() const
+    {
+        return id_;
+    }
+
+private:
+    struct Order
+    {
+        // last word of every n-gram, unused for unigrams
+        const uint32_t* words;
+        const float* log_probs;
+        // none for the highest order
+        const float* backoffs;
+        // continuations of entry i are [first_children[i], first_children[i + 1]) of the next order
+        const uint32_t* first_children;
+        // entry of the longest proper suffix of every n-gram the model has, unused for unigrams
+        const uint32_t* suffixes;
+        uint32_t first_entry;
+        uint32_t num_entries;
+    };
+
+    explicit NGramModel(const std::string& path);
+
+    void read_arpa(std::istream& stream);
+    void map_binary(std::istream& stream, size_t size);
+    // point the orders and the vocabulary into data_
+    void attach(const char* data, size_t size);
+
+    std::string path_;
+    uint64_t id_;
+    // the binary image, either owned or memory mapped
+    std::vector<uint64_t> owned_;
+    std::unique_ptr<fst::MappedFile> mapped_;
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+
+    size_t order_ = 0;
+    size_t vocabulary_size_ = 0;
+    std::vector<Order> orders_;
+    const uint64_t* word_offsets_ = nullptr;
+    const char* word_chars_ = nullptr;
+    std::unordered_map<std::string, uint32_t> word_indices_;
+    uint32_t unknown_word_ = 0;
+    uint32_t start_state_ = 0;
+};
+
+/* State of a prefix in a LanguageModel: the n-gram state of its words, and for
+ * word-level models where it is in the spelling of its unfinished word.
+ */
+struct LanguageModelState
+{
+    uint32_t context;
+    int32_t spelling;
+};
+
+/* NGramModel over the tokens of a decoder. Token-level models score every
+ * token as a word, the label of the token. Word-level ones score a word when
+ * the separator token follows it, the word being spelled with the labels.
+ */
+class LanguageModel
+{
+public:
+    // spelling of a word that isn't in the model, it is scored as <unk>
+    static constexpr int32_t UNKNOWN_SPELLING = -1;
+
+    /* Parameters:
+     *     path: ARPA or binary file of the NGramModel, which is shared by the
+     *           language models loaded from it.
+     *     labels: Label of every token. Empty ones, e.g. of the blank, are
+     *             never part of a word.
+     *     separator_id: Token ending a word for a word-level model, -1 for a
+     *                   token-level one.
+     * Throws std::invalid_argument if the model can't be loaded.
+     */
+    static std::shared_ptr<const LanguageModel> load(
+        const std::string& path, const std::vector<std::string>& labels, int separator_id);
+
+    LanguageModel(const LanguageModel&) = delete;
+    LanguageModel& operator=(const LanguageModel&) = delete;
+
+    LanguageModelState get_start_state() const
+    {
+        return { ngrams_->get_start_state(), 0 };
+    }
+
+    /* Word of the model that token ends after state, or -1 if it doesn't end
+     * one. spelling is set to where the token leaves the unfinished word of
+     * the next state, whose context only changes if a word ends. Tokens
+     * without a label are unknown words.
+     */
+    int64_t end_word(LanguageModelState state, int token, int32_t& spelling) const;
+
+    // whether state is one of this model, e.g. read from a snapshot
+    bool is_valid(LanguageModelState state) const;
+
+    const NGramModel& get_ngrams() const
+    {
+        return *ngrams_;
+    }
+
+    const std::vector<std::string>& get_labels() const
+    {
+        return labels_;
+    }
+
+    int get_separator_id() const
+    {
+        return separator_id_;
+    }
+
+private:
+    LanguageModel(const std::string& path, const std::vector<std::string>& labels, int separator_id);
+
+    std::shared_ptr<const NGramModel> ngrams_;
+    std::vector<std::string> labels_;
+    int separator_id_;
+    // word of every token for token-level models
+    std::vector<uint32_t> token_words_;
+    // spellings of the words as a trie of tokens keyed by (node, token), node 0 being the empty spelling
+    std::unordered_map<uint64_t, int32_t> spelling_children_;
+    // word spelled by every node, NO_WORD for the prefixes of words
+    std::vector<uint32_t> spelling_words_;
+
+    static constexpr uint32_t NO_WORD = UINT32_MAX;
+};
+
+/* Scores the tokens of prefixes with a LanguageModel, weighted by alpha and
+ * beta. The n-gram scores of (state, word) pairs, which come up again and
+ * again across the prefixes of a beam and across frames, are cached per
+ * thread rather than per scorer: every scorer used on a thread shares its
+ * cache, whatever the model, so that thousands of streams don't each keep
+ * one. The cache is allocated the first time a thread scores a word.
+ */
+class LanguageModelScorer
+{
+public:
+    // score with language_model from now on, keeping it alive. Null unbinds the scorer.
+    void bind(const std::shared_ptr<const LanguageModel>& language_model, float alpha, float beta);
+
+    bool is_bound() const
+    {
+        return language_model_ != nullptr;
+    }
+
+    LanguageModelState start() const
+    {
+        return language_model_->get_start_state();
+    }
+
+    // state after token, returning alpha times the log probability of the word it ends plus beta, 0 if it
+    // doesn't end one
+    float next(LanguageModelState state, int token, LanguageModelState& next_state);
+
+private:
+    struct CacheEntry
+    {
+        // id of the n-gram model, 0 for an empty entry
+        uint64_t model;
+        uint32_t state;
+        uint32_t word;
+        uint32_t next_state;
+        float log_prob;
+    };
+
+    static constexpr int CACHE_BITS = 16;
+    static constexpr size_t CACHE_SIZE = size_t(1) << CACHE_BITS;
+
+    // cache of the calling thread
+    static std::vector<CacheEntry>& cache_for_this_thread();
+
+    std::shared_ptr<const LanguageModel> language_model_;
+    float alpha_ = 0.0f;
+    float beta_ = 0.0f;
+    uint64_t model_id_ = 0;
+};
@@ -0,0 +1,77 @@
+#include "lexicon.h"
+
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+
+using namespace std;
+
+namespace
+{
+mutex loaded_lexicons_mutex;
+// lexicons by path, for as long as a decoder or an option still holds them
+unordered_map<string, weak_ptr<const Lexicon>> loaded_lexicons;
+}
+
+Lexicon::Lexicon(const string& path)
+    : path_(path)
+{
+    ifstream stream(path, ios_base::in | ios_base::binary);
+    if (!stream)
+        throw invalid_argument("can't open lexicon " + path);
+
+    // mapped rather than read, the pages are shared with every other process using the file
+    fst::FstReadOptions read_options(path);
+    read_options.mode = fst::FstReadOptions::MAP;
+    fst_.reset(fst::StdConstFst::Read(stream, read_options));
+    if (fst_ == nullptr)
+        throw invalid_argument("lexicon " + path + " isn't a ConstFst over the standard arc type");
+    if (fst_->Start() == fst::kNoStateId)
+        throw invalid_argument("lexicon " + path + " is empty");
+    // the stored properties, computing them would read the whole FST
+    if (fst_->Properties(fst::kILabelSorted, false) == 0)
+        throw invalid_argument("the arcs of lexicon " + path + " aren't sorted by input label, see fstarcsort");
+}
+
+shared_ptr<const Lexicon> Lexicon::load(const string& path)
+{
+    lock_guard<mutex> lock(loaded_lexicons_mutex);
+    auto& loaded = loaded_lexicons[path];
+    shared_ptr<const Lexicon> lexicon = loaded.lock();
+    if (lexicon == nullptr)
+    {
+        lexicon.reset(new Lexicon(path));
+        loaded = lexicon;
+    }
+    return lexicon;
+}
+
+void LexiconMatcher::bind(const shared_ptr<const Lexicon>& lexicon)
+{
+    if (lexicon == lexicon_)
+        return;
+    matcher_.reset();
+    lexicon_ = lexicon;
+    if (lexicon_ != nullptr)
+    {
+        // from a pointer, so that the matcher doesn't hold a copy of the FST
+        matcher_.reset(new fst::SortedMatcher<fst::StdConstFst>(&lexicon_->get_fst(), fst::MATCH_INPUT));
+    }
+}
+
+LexiconMatcher::StateId LexiconMatcher::next(StateId state, int token)
+{
+    matcher_->SetState(state);
+    if (matcher_->Find(token + 1))
+        return matcher_->Value().nextstate;
+
+    // a word ends here, the token may start the next one
+    const auto& lexicon = lexicon_->get_fst();
+    if (state == lexicon.Start() || lexicon.Final(state) == fst::TropicalWeight::Zero())
+        return fst::kNoStateId;
+    matcher_->SetState(lexicon.Start());
+    if (matcher_->Find(token + 1))
+        return matcher_->Value().nextstate;
+    return fst::kNoStateId;
+}
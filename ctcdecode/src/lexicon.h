@@ -0,0 +1,84 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "fst/fstlib.h"
+
+/* Lexicon constraining the prefixes of a beam search to sequences of its
+ * words. It is an acceptor of the token sequences of the words, with label
+ * token + 1 since label 0 is epsilon, which isn't followed. A prefix in a
+ * final state can go on with the word, or start the next one from the start
+ * state. For vocabularies with a word separator, the separator is part of the
+ * words, e.g. at their end. A deterministic FST gives one state per prefix,
+ * otherwise the first matching arc is taken.
+ *
+ * The FST is read-only once loaded and shared by every decoder and thread
+ * using the lexicon, the position of a lookup is kept in a LexiconMatcher.
+ */
+class Lexicon
+{
+public:
+    /* Load an arc-sorted ConstFst over the standard arc type, e.g. written by
+     * fstconvert --fst_type=const --fst_align, memory mapping it if it is
+     * aligned. A file already loaded and still in use is shared rather than
+     * loaded again, so that the number of decoders doesn't change the cost.
+     * Throws std::invalid_argument if the file can't be read.
+     */
+    static std::shared_ptr<const Lexicon> load(const std::string& path);
+
+    Lexicon(const Lexicon&) = delete;
+    Lexicon& operator=(const Lexicon&) = delete;
+
+    const fst::StdConstFst& get_fst() const
+    {
+        return *fst_;
+    }
+
+    const std::string& get_path() const
+    {
+        return path_;
+    }
+
+    // whether state is one of the FST's, e.g. one read back from a snapshot
+    bool is_valid(fst::StdArc::StateId state) const
+    {
+        return state >= 0 && state < fst_->NumStates();
+    }
+
+private:
+    explicit Lexicon(const std::string& path);
+
+    std::unique_ptr<fst::StdConstFst> fst_;
+    std::string path_;
+};
+
+/* Lookups into a Lexicon. A matcher keeps the position of its last lookup, so
+ * every thread expanding prefixes has its own, and it doesn't copy the FST.
+ */
+class LexiconMatcher
+{
+public:
+    using StateId = fst::StdArc::StateId;
+
+    // look up lexicon from now on, keeping it alive. Null unbinds the matcher.
+    void bind(const std::shared_ptr<const Lexicon>& lexicon);
+
+    bool is_bound() const
+    {
+        return lexicon_ != nullptr;
+    }
+
+    StateId start() const
+    {
+        return lexicon_->get_fst().Start();
+    }
+
+    // state after token from state, restarting at the start state if state ends a word the token doesn't go on
+    // with, or fst::kNoStateId if the lexicon doesn't allow the token
+    StateId next(StateId state, int token);
+
+private:
+    std::shared_ptr<const Lexicon> lexicon_;
+    std::unique_ptr<fst::SortedMatcher<fst::StdConstFst>> matcher_;
+};
@@ -0,0 +1,60 @@
+#pragma once
+#include <cstddef>
+
+/* Non-owning view over a [time, vocabulary] matrix of log probabilities. Strides are counted in elements rather than
+ * bytes, so any float32 numpy array (including non-contiguous slices) can be read in place without a copy.
+ */
+struct LogProbsView
+{
+    const float* data;
+    size_t num_time_steps, num_classes;
+    std::ptrdiff_t time_stride, class_stride;
+
+    LogProbsView()
+        : data(nullptr)
+        , num_time_steps(0)
+        , num_classes(0)
+        , time_stride(0)
+        , class_stride(1)
+    {}
+
+    LogProbsView(
+        const float* data,
+        size_t num_time_steps,
+        size_t num_classes,
+        std::ptrdiff_t time_stride,
+        std::ptrdiff_t class_stride = 1)
+        : data(data)
+        , num_time_steps(num_time_steps)
+        , num_classes(num_classes)
+        , time_stride(time_stride)
+        , class_stride(class_stride)
+    {}
+
+    // contiguous, row-major matrix
+    LogProbsView(const float* data, size_t num_time_steps, size_t num_classes)
+        : LogProbsView(data, num_time_steps, num_classes, static_cast<std::ptrdiff_t>(num_classes))
+    {}
+
+    size_t size() const
+    {
+        return num_time_steps;
+    }
+
+    // first element of the given time step, the following ones are class_stride apart
+    const float* row(size_t time_step) const
+    {
+        return data + static_cast<std::ptrdiff_t>(time_step) * time_stride;
+    }
+
+    float operator()(size_t time_step, size_t c) const
+    {
+        return row(time_step)[static_cast<std::ptrdiff_t>(c) * class_stride];
+    }
+
+    // time steps [begin, end)
+    LogProbsView frames(size_t begin, size_t end) const
+    {
+        return LogProbsView(row(begin), end - begin, num_classes, time_stride, class_stride);
+    }
+};
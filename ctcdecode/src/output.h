@@ -17,3 +17,28 @@ struct Output
         , timesteps(timesteps)
     {}
 };
+
+/* n-best of a decoder as a prefix tree: candidates share the nodes of their
+ * common prefix, so the size of a lattice grows with the number of distinct
+ * tokens instead of the number of candidates times their length. A node comes
+ * after its parent.
+ */
+struct Lattice
+{
+    // token, timestep and parent of every node, the parent of a first token is -1
+    std::vector<int> tokens, timesteps, parents;
+    // log probability of the best candidate going through every node
+    std::vector<float> log_probs;
+    // last node of every candidate, best first, -1 for the empty candidate
+    std::vector<int> candidates;
+    std::vector<float> candidate_log_probs;
+
+    int add_node(int token, int timestep, int parent, float log_prob)
+    {
+        tokens.push_back(token);
+        timesteps.push_back(timestep);
+        parents.push_back(parent);
+        log_probs.push_back(log_prob);
+        return static_cast<int>(tokens.size()) - 1;
+    }
+};
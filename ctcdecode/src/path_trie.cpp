@@ -3,13 +3,25 @@
 #include <algorithm>
 #include <limits>
 #include <memory>
+#include <stdexcept>
 #include <utility>
 #include <vector>
 
 #include "decoder_utils.h"
+#include "snapshot.h"
 using namespace std;
 
+namespace
+{
+const uint32_t NO_PARENT = numeric_limits<uint32_t>::max();
+}
+
 PathTrie::PathTrie()
+{
+    reset();
+}
+
+void PathTrie::reset()
 {
     log_prob_b_prev = -NUM_FLT_INF;
     log_prob_nb_prev = -NUM_FLT_INF;
@@ -17,115 +29,78 @@ PathTrie::PathTrie()
     log_prob_nb_cur = -NUM_FLT_INF;
     log_prob_c = -NUM_FLT_INF;
     score = -NUM_FLT_INF;
+    lm_score = 0.0f;
 
-    ROOT_ = -1;
     character = ROOT_;
     timestep = 0;
     exists_ = true;
     parent = nullptr;
+    first_child_ = nullptr;
+    next_sibling_ = nullptr;
 
-    dictionary_ = nullptr;
-    dictionary_state_ = 0;
-    has_dictionary_ = false;
-
-    matcher_ = nullptr;
-}
-
-PathTrie::~PathTrie()
-{
-    for (auto child : children_)
-    {
-        delete child.second;
-    }
+    lexicon_state_ = 0;
+    lm_state_ = LanguageModelState { 0, 0 };
 }
 
-PathTrie* PathTrie::get_path_trie(int new_char, int new_timestep, float cur_log_prob_c, bool reset)
+PathTrie* PathTrie::get_path_trie(
+    int new_char,
+    int new_timestep,
+    float cur_log_prob_c,
+    PathTrieArena& arena,
+    vector<PathTrie*>& activated,
+    LexiconMatcher* lexicon,
+    LanguageModelScorer* language_model)
 {
-    auto child = children_.begin();
-    for (child = children_.begin(); child != children_.end(); ++child)
+    PathTrie* last_child = nullptr;
+    for (PathTrie* child = first_child_; child != nullptr; child = child->next_sibling_)
     {
-        if (child->first == new_char)
+        if (child->character == new_char)
         {
-            if (child->second->log_prob_c < cur_log_prob_c)
+            if (child->log_prob_c < cur_log_prob_c)
             {
-                child->second->log_prob_c = cur_log_prob_c;
-                child->second->timestep = new_timestep;
+                child->log_prob_c = cur_log_prob_c;
+                child->timestep = new_timestep;
             }
-            break;
+            if (!child->exists_)
+            {
+                child->exists_ = true;
+                child->log_prob_b_prev = -NUM_FLT_INF;
+                child->log_prob_nb_prev = -NUM_FLT_INF;
+                child->log_prob_b_cur = -NUM_FLT_INF;
+                child->log_prob_nb_cur = -NUM_FLT_INF;
+                activated.push_back(child);
+            }
+            return child;
         }
+        last_child = child;
     }
-    if (child != children_.end())
+
+    LexiconMatcher::StateId lexicon_state = 0;
+    if (lexicon != nullptr)
     {
-        if (!child->second->exists_)
-        {
-            child->second->exists_ = true;
-            child->second->log_prob_b_prev = -NUM_FLT_INF;
-            child->second->log_prob_nb_prev = -NUM_FLT_INF;
-            child->second->log_prob_b_cur = -NUM_FLT_INF;
-            child->second->log_prob_nb_cur = -NUM_FLT_INF;
-        }
-        return (child->second);
+        lexicon_state = lexicon->next(lexicon_state_, new_char);
+        if (lexicon_state == fst::kNoStateId)
+            return nullptr;
     }
-    else
+
+    PathTrie* new_path = arena.acquire();
+    new_path->character = new_char;
+    new_path->timestep = new_timestep;
+    new_path->parent = this;
+    new_path->log_prob_c = cur_log_prob_c;
+    new_path->lexicon_state_ = lexicon_state;
+    if (language_model != nullptr)
     {
-        if (has_dictionary_)
-        {
-            matcher_->SetState(dictionary_state_);
-            bool found = matcher_->Find(new_char + 1);
-            if (!found)
-            {
-                // Adding this character causes word outside dictionary
-                auto FSTZERO = fst::TropicalWeight::Zero();
-                auto final_weight = dictionary_->Final(dictionary_state_);
-                bool is_final = (final_weight != FSTZERO);
-                if (is_final && reset)
-                {
-                    dictionary_state_ = dictionary_->Start();
-                }
-                return nullptr;
-            }
-            else
-            {
-                PathTrie* new_path = new PathTrie;
-                new_path->character = new_char;
-                new_path->timestep = new_timestep;
-                new_path->parent = this;
-                new_path->dictionary_ = dictionary_;
-                new_path->has_dictionary_ = true;
-                new_path->matcher_ = matcher_;
-                new_path->log_prob_c = cur_log_prob_c;
-
-                // set spell checker state
-                // check to see if next state is final
-                auto FSTZERO = fst::TropicalWeight::Zero();
-                auto final_weight = dictionary_->Final(matcher_->Value().nextstate);
-                bool is_final = (final_weight != FSTZERO);
-                if (is_final && reset)
-                {
-                    // restart spell checker at the start state
-                    new_path->dictionary_state_ = dictionary_->Start();
-                }
-                else
-                {
-                    // go to next state
-                    new_path->dictionary_state_ = matcher_->Value().nextstate;
-                }
-
-                children_.push_back(make_pair(new_char, new_path));
-                return new_path;
-            }
-        }
-        else
-        {
-            PathTrie* new_path = new PathTrie;
-            new_path->character = new_char;
-            new_path->timestep = new_timestep;
-            new_path->parent = this;
-            new_path->log_prob_c = cur_log_prob_c;
-            children_.push_back(make_pair(new_char, new_path));
-            return new_path;
-        }
+        new_path->lm_score = language_model->next(lm_state_, new_char, new_path->lm_state_);
     }
+
+    // append, so that children keep their insertion order
+    if (last_child != nullptr)
+        last_child->next_sibling_ = new_path;
+    else
+        first_child_ = new_path;
+    activated.push_back(new_path);
+    return new_path;
 }
 
 PathTrie* PathTrie::get_path_vec(vector<int>& output, vector<int>& timesteps)
@@ -135,73 +110,219 @@ PathTrie* PathTrie::get_path_vec(vector<int>& output, vector<int>& timesteps)
 
 PathTrie* PathTrie::get_path_vec(vector<int>& output, vector<int>& timesteps, int stop, size_t max_steps)
 {
-    if (character == stop || character == ROOT_ || output.size() == max_steps)
+    // the root has no parent, which is also true of a node the trie was re-rooted at
+    PathTrie* node = this;
+    while (node->character != stop && node->parent != nullptr && output.size() != max_steps)
     {
-        reverse(output.begin(), output.end());
-        reverse(timesteps.begin(), timesteps.end());
-        return this;
+        output.push_back(node->character);
+        timesteps.push_back(node->timestep);
+        node = node->parent;
     }
-    else
+    reverse(output.begin(), output.end());
+    reverse(timesteps.begin(), timesteps.end());
+    return node;
+}
+
+PathTrie* PathTrie::commit_stable_prefix(PathTrieArena& arena, vector<int>& tokens, vector<int>& timesteps)
+{
+    // a node out of the beam always has children, with a single one every prefix goes through it. Nodes above the
+    // new root are out of the beam and can't get new children, so the committed timesteps are final.
+    PathTrie* node = this;
+    while (!node->exists_ && node->first_child_->next_sibling_ == nullptr)
+    {
+        PathTrie* child = node->first_child_;
+        tokens.push_back(child->character);
+        timesteps.push_back(child->timestep);
+        arena.release(node);
+        node = child;
+    }
+    node->parent = nullptr;
+    return node;
+}
+
+void PathTrie::save(SnapshotWriter& writer, unordered_map<const PathTrie*, uint32_t>& numbers) const
+{
+    // breadth first, so that a node is read after its parent and after its previous siblings
+    vector<const PathTrie*> nodes(1, this);
+    for (size_t i = 0; i < nodes.size(); ++i)
     {
-        output.push_back(character);
-        timesteps.push_back(timestep);
-        return parent->get_path_vec(output, timesteps, stop, max_steps);
+        for (const PathTrie* child = nodes[i]->first_child_; child != nullptr; child = child->next_sibling_)
+        {
+            nodes.push_back(child);
+        }
+    }
+
+    numbers.clear();
+    writer.write<uint64_t>(nodes.size());
+    for (const PathTrie* node : nodes)
+    {
+        writer.write<uint32_t>(node == this ? NO_PARENT : numbers.at(node->parent));
+        uint32_t number = static_cast<uint32_t>(numbers.size());
+        numbers.emplace(node, number);
+
+        writer.write<int32_t>(node->character);
+        writer.write<int32_t>(node->timestep);
+        writer.write(node->log_prob_b_prev);
+        writer.write(node->log_prob_nb_prev);
+        writer.write(node->log_prob_b_cur);
+        writer.write(node->log_prob_nb_cur);
+        writer.write(node->log_prob_c);
+        writer.write(node->score);
+        writer.write(node->lm_score);
+        writer.write<int64_t>(node->lexicon_state_);
+        writer.write(node->lm_state_);
+        writer.write<uint8_t>(node->exists_);
     }
 }
 
-void PathTrie::iterate_to_vec(vector<PathTrie*>& output)
+void PathTrie::load(
+    SnapshotReader& reader,
+    PathTrieArena& arena,
+    vector<PathTrie*>& nodes,
+    const Lexicon* lexicon,
+    const LanguageModel* language_model)
 {
-    if (exists_)
+    uint64_t num_nodes = reader.read<uint64_t>();
+    if (num_nodes == 0)
+        throw invalid_argument("corrupt decoder snapshot");
+
+    nodes.clear();
+    // last child read so far of every node, which the next one is appended to
+    vector<PathTrie*> last_children;
+    for (uint64_t i = 0; i < num_nodes; ++i)
     {
-        log_prob_b_prev = log_prob_b_cur;
-        log_prob_nb_prev = log_prob_nb_cur;
+        uint32_t parent = reader.read<uint32_t>();
+        if (i == 0 ? parent != NO_PARENT : parent >= i)
+            throw invalid_argument("corrupt decoder snapshot");
+
+        PathTrie* node = arena.acquire();
+        nodes.push_back(node);
+        last_children.push_back(nullptr);
 
-        log_prob_b_cur = -NUM_FLT_INF;
-        log_prob_nb_cur = -NUM_FLT_INF;
+        node->character = reader.read<int32_t>();
+        node->timestep = reader.read<int32_t>();
+        node->log_prob_b_prev = reader.read<float>();
+        node->log_prob_nb_prev = reader.read<float>();
+        node->log_prob_b_cur = reader.read<float>();
+        node->log_prob_nb_cur = reader.read<float>();
+        node->log_prob_c = reader.read<float>();
+        node->score = reader.read<float>();
+        node->lm_score = reader.read<float>();
+        node->lexicon_state_ = static_cast<LexiconMatcher::StateId>(reader.read<int64_t>());
+        if (lexicon != nullptr ? !lexicon->is_valid(node->lexicon_state_) : node->lexicon_state_ != 0)
+            throw invalid_argument("corrupt decoder snapshot");
+        node->lm_state_ = reader.read<LanguageModelState>();
+        if (language_model != nullptr && !language_model->is_valid(node->lm_state_))
+            throw invalid_argument("corrupt decoder snapshot");
+        node->exists_ = reader.read<uint8_t>() != 0;
+
+        if (i > 0)
+        {
+            node->parent = nodes[parent];
+            if (last_children[parent] != nullptr)
+                last_children[parent]->next_sibling_ = node;
+            else
+                node->parent->first_child_ = node;
+            last_children[parent] = node;
+        }
+    }
+}
 
-        score = log_sum_exp(log_prob_b_prev, log_prob_nb_prev);
-        output.push_back(this);
+bool PathTrie::is_valid_beam(const vector<PathTrie*>& nodes, const vector<uint32_t>& prefixes)
+{
+    vector<bool> in_beam(nodes.size(), false);
+    for (uint32_t prefix : prefixes)
+    {
+        if (prefix >= nodes.size() || in_beam[prefix])
+            return false;
+        in_beam[prefix] = true;
     }
-    for (auto child : children_)
+    // remove and commit_stable_prefix rely on a node out of the beam having children, it would have been removed
+    // otherwise
+    for (size_t i = 0; i < nodes.size(); ++i)
     {
-        child.second->iterate_to_vec(output);
+        if (nodes[i]->exists_ != in_beam[i] || (!in_beam[i] && nodes[i]->first_child_ == nullptr))
+            return false;
     }
+    return true;
 }
 
-void PathTrie::remove()
+void PathTrie::remove(PathTrieArena& arena)
 {
     exists_ = false;
 
-    if (children_.size() == 0)
+    if (first_child_ == nullptr)
     {
-        auto child = parent->children_.begin();
-        for (child = parent->children_.begin(); child != parent->children_.end(); ++child)
+        PathTrie** link = &parent->first_child_;
+        while (*link != this)
         {
-            if (child->first == character)
-            {
-                parent->children_.erase(child);
-                break;
-            }
+            link = &(*link)->next_sibling_;
         }
+        *link = next_sibling_;
 
-        if (parent->children_.size() == 0 && !parent->exists_)
+        if (parent->first_child_ == nullptr && !parent->exists_)
         {
-            parent->remove();
+            parent->remove(arena);
         }
 
-        delete this;
+        arena.release(this);
     }
 }
 
-void PathTrie::set_dictionary(fst::StdVectorFst* dictionary)
+void PathTrie::set_lexicon(const LexiconMatcher& lexicon)
 {
-    dictionary_ = dictionary;
-    dictionary_state_ = dictionary->Start();
-    has_dictionary_ = true;
+    lexicon_state_ = lexicon.start();
 }
 
-using FSTMATCH = fst::SortedMatcher<fst::StdVectorFst>;
-void PathTrie::set_matcher(shared_ptr<FSTMATCH> matcher)
+void PathTrie::set_language_model(const LanguageModelScorer& language_model)
 {
-    matcher_ = matcher;
+    lm_state_ = language_model.start();
+}
+
+PathTrie* PathTrieArena::acquire()
+{
+    PathTrie* node;
+    if (free_ != nullptr)
+    {
+        node = free_;
+        free_ = node->next_sibling_;
+        --num_free_;
+    }
+    else
+    {
+        if (num_carved_ == blocks_.size() * BLOCK_SIZE)
+        {
+            blocks_.emplace_back(new PathTrie[BLOCK_SIZE]);
+        }
+        node = &blocks_[num_carved_ / BLOCK_SIZE][num_carved_ % BLOCK_SIZE];
+        ++num_carved_;
+    }
+    node->reset();
+    return node;
+}
+
+void PathTrieArena::release(PathTrie* node)
+{
+    node->next_sibling_ = free_;
+    free_ = node;
+    ++num_free_;
+}
+
+void PathTrieArena::clear()
+{
+    // nodes are trivially destructible, so forgetting about them is enough
+    num_carved_ = 0;
+    free_ = nullptr;
+    num_free_ = 0;
+}
+
+void PathTrieArena::give_free_nodes(PathTrieArena& other, size_t max_nodes)
+{
+    for (size_t i = 0; i < max_nodes && free_ != nullptr; ++i)
+    {
+        PathTrie* node = free_;
+        free_ = node->next_sibling_;
+        --num_free_;
+        other.release(node);
+    }
 }
@@ -1,26 +1,45 @@
 #pragma once
 
 #include <algorithm>
+#include <cstdint>
 #include <limits>
 #include <memory>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
-#include "fst/fstlib.h"
+#include "language_model.h"
+#include "lexicon.h"
 
-/* Trie tree for prefix storing and manipulating, with a dictionary in
- * finite-state transducer for spelling correction.
+class PathTrieArena;
+class SnapshotReader;
+class SnapshotWriter;
+
+/* Trie tree for prefix storing and manipulating, optionally constrained by a
+ * Lexicon and scored by a LanguageModel, of which every node keeps its state.
+ *
+ * Nodes are allocated from a PathTrieArena and are trivially destructible, the
+ * children of a node form a singly-linked list in insertion order.
  */
 class PathTrie
 {
 public:
     PathTrie();
-    ~PathTrie();
 
-    // get new prefix after appending new char
-    PathTrie* get_path_trie(int new_char, int new_timestep, float log_prob_c, bool reset = true);
+    // get new prefix after appending new char, allocating new nodes from arena.
+    // Nodes that are created or brought back to life are appended to activated.
+    // With a bound lexicon, null if the lexicon doesn't allow new_char after this prefix. With a bound language
+    // model, new nodes get the lm_score of new_char.
+    PathTrie* get_path_trie(
+        int new_char,
+        int new_timestep,
+        float log_prob_c,
+        PathTrieArena& arena,
+        std::vector<PathTrie*>& activated,
+        LexiconMatcher* lexicon = nullptr,
+        LanguageModelScorer* language_model = nullptr);
 
-    // get the prefix in index from root to current node
+    // get the prefix in index from root to current node, without the root's own character
     PathTrie* get_path_vec(std::vector<int>& output, std::vector<int>& timesteps);
 
     // get the prefix in index from some stop node to current nodel
@@ -30,21 +49,59 @@ public:
         int stop,
         size_t max_steps = std::numeric_limits<size_t>::max());
 
-    // update log probs
-    void iterate_to_vec(std::vector<PathTrie*>& output);
+    // update log probs at the end of a time step, adding up the blank and
+    // non-blank paths with log_add
+    template <typename LogAdd>
+    void update_log_probs(LogAdd log_add)
+    {
+        log_prob_b_prev = log_prob_b_cur;
+        log_prob_nb_prev = log_prob_nb_cur;
+
+        log_prob_b_cur = -std::numeric_limits<float>::max();
+        log_prob_nb_cur = -std::numeric_limits<float>::max();
+
+        score = log_add(log_prob_b_prev, log_prob_nb_prev);
+    }
+
+    // called on the root: follow the chain of nodes every prefix of the beam goes through, appending their
+    // characters and timesteps, which can't change anymore, and release the nodes above the last one. That node is
+    // returned as the new root.
+    PathTrie* commit_stable_prefix(PathTrieArena& arena, std::vector<int>& tokens, std::vector<int>& timesteps);
+
+    // write the trie below this node, parents before their children and children in their order, numbering the
+    // nodes from 0 in that order
+    void save(SnapshotWriter& writer, std::unordered_map<const PathTrie*, uint32_t>& numbers) const;
 
-    // set dictionary for FST
-    void set_dictionary(fst::StdVectorFst* dictionary);
+    // read a trie written by save, allocating its nodes from arena. nodes are in the order of their numbers, the
+    // first one is the root. The states of lexicon and language_model, if any, are checked, lexicon states must be
+    // 0 without a lexicon.
+    static void load(
+        SnapshotReader& reader,
+        PathTrieArena& arena,
+        std::vector<PathTrie*>& nodes,
+        const Lexicon* lexicon = nullptr,
+        const LanguageModel* language_model = nullptr);
 
-    void set_matcher(std::shared_ptr<fst::SortedMatcher<fst::StdVectorFst>>);
+    // whether the prefixes, numbers of nodes read by load, can be the beam of that trie: distinct, exactly the
+    // nodes that exist, and every other node leads to one of them
+    static bool is_valid_beam(const std::vector<PathTrie*>& nodes, const std::vector<uint32_t>& prefixes);
+
+    // start matching the lexicon from this node
+    void set_lexicon(const LexiconMatcher& lexicon);
+
+    // start scoring with the language model from this node
+    void set_language_model(const LanguageModelScorer& language_model);
 
     bool is_empty()
     {
         return ROOT_ == character;
     }
 
-    // remove current path from root
-    void remove();
+    // remove current path from root, handing freed nodes back to arena
+    void remove(PathTrieArena& arena);
+
+    // reset to the state of a freshly constructed node
+    void reset();
 
     float log_prob_b_prev;
     float log_prob_nb_prev;
@@ -52,21 +109,61 @@ public:
     float log_prob_nb_cur;
     float log_prob_c;
     float score;
-    float approx_ctc;
+    // weighted language model score of the character after the parent's prefix, part of the paths into the node
+    float lm_score;
     int character;
     int timestep;
     PathTrie* parent;
 
 private:
-    int ROOT_;
+    static constexpr int ROOT_ = -1;
+
+    PathTrie* first_child_;
+    // next child of parent, or the next free node while in the arena's free list
+    PathTrie* next_sibling_;
+
+    LexiconMatcher::StateId lexicon_state_;
+    LanguageModelState lm_state_;
     bool exists_;
-    bool has_dictionary_;
 
-    std::vector<std::pair<int, PathTrie*>> children_;
+    friend class PathTrieArena;
+};
+
+/* Slab allocator for the nodes of one trie. Nodes are carved out of large
+ * blocks and removed ones are recycled through a free list. clear() frees the
+ * whole trie in O(1) and keeps the blocks for the next one.
+ */
+class PathTrieArena
+{
+public:
+    PathTrieArena() = default;
+    PathTrieArena(const PathTrieArena&) = delete;
+    PathTrieArena& operator=(const PathTrieArena&) = delete;
+
+    // a freshly reset node
+    PathTrie* acquire();
+
+    // node must not have children anymore
+    void release(PathTrie* node);
+
+    // release every node at once
+    void clear();
+
+    size_t num_free() const
+    {
+        return num_free_;
+    }
+
+    // move up to max_nodes released nodes to the free list of other. The nodes
+    // of a trie can be spread over several arenas this way, which must then be
+    // cleared together.
+    void give_free_nodes(PathTrieArena& other, size_t max_nodes);
+
+private:
+    static constexpr size_t BLOCK_SIZE = 4096;
 
-    // pointer to dictionary of FST
-    fst::StdVectorFst* dictionary_;
-    fst::StdVectorFst::StateId dictionary_state_;
-    // true if finding ars in FST
-    std::shared_ptr<fst::SortedMatcher<fst::StdVectorFst>> matcher_;
+    std::vector<std::unique_ptr<PathTrie[]>> blocks_;
+    size_t num_carved_ = 0;
+    PathTrie* free_ = nullptr;
+    size_t num_free_ = 0;
 };
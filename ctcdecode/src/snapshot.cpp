@@ -0,0 +1,111 @@
+#include "snapshot.h"
+
+#include "language_model.h"
+#include "lexicon.h"
+
+using namespace std;
+
+namespace
+{
+const uint32_t SNAPSHOT_MAGIC = 0x44435443;  // "CTCD" in little endian
+const uint32_t SNAPSHOT_VERSION = 4;
+}
+
+void write_snapshot_header(SnapshotWriter& writer, SnapshotKind kind, const DecoderOptions& options)
+{
+    writer.write(SNAPSHOT_MAGIC);
+    writer.write(SNAPSHOT_VERSION);
+    writer.write(kind);
+
+    // field by field, so that the padding of DecoderOptions isn't part of the snapshot
+    writer.write<uint64_t>(options.beam_size);
+    writer.write(options.cutoff_prob);
+    writer.write<uint64_t>(options.cutoff_top_n);
+    writer.write<uint64_t>(options.blank_id);
+    writer.write(options.engine);
+    writer.write(options.merge_mode);
+    writer.write(options.blank_skip_threshold);
+    writer.write(options.beam_threshold);
+    writer.write<uint64_t>(options.num_expansion_threads);
+    writer.write<uint64_t>(options.segment_blank_frames);
+    writer.write(options.segment_blank_threshold);
+    writer.write<uint64_t>(options.max_uncommitted_frames);
+    writer.write<uint64_t>(options.endpoint_blank_frames);
+    writer.write(options.endpoint_blank_threshold);
+    writer.write(options.endpoint_score_margin);
+    // the lexicon by its path, it is loaded again on restore, or shared if it already is
+    writer.write_string(options.lexicon != nullptr ? options.lexicon->get_path() : string());
+    // the language model likewise, with the labels and the separator it was loaded with
+    const auto& language_model = options.language_model;
+    writer.write_string(language_model != nullptr ? language_model->get_ngrams().get_path() : string());
+    if (language_model != nullptr)
+    {
+        writer.write<uint64_t>(language_model->get_labels().size());
+        for (const auto& label : language_model->get_labels())
+        {
+            writer.write_string(label);
+        }
+        writer.write<int32_t>(language_model->get_separator_id());
+    }
+    writer.write(options.lm_alpha);
+    writer.write(options.lm_beta);
+}
+
+DecoderOptions read_snapshot_header(SnapshotReader& reader, SnapshotKind kind)
+{
+    if (reader.read<uint32_t>() != SNAPSHOT_MAGIC)
+        throw invalid_argument("not a decoder snapshot, or written on a host of another byte order");
+    if (reader.read<uint32_t>() != SNAPSHOT_VERSION)
+        throw invalid_argument("decoder snapshot of another version of the library");
+    if (reader.read<SnapshotKind>() != kind)
+        throw invalid_argument("decoder snapshot of another kind of decoder");
+
+    DecoderOptions options;
+    options.beam_size = reader.read<uint64_t>();
+    options.cutoff_prob = reader.read<float>();
+    options.cutoff_top_n = reader.read<uint64_t>();
+    options.blank_id = reader.read<uint64_t>();
+    options.engine = reader.read<BeamEngine>();
+    if (options.engine != BeamEngine::trie && options.engine != BeamEngine::hashed)
+        throw invalid_argument("decoder snapshot with an unknown engine");
+    options.merge_mode = reader.read<MergeMode>();
+    if (options.merge_mode != MergeMode::exact && options.merge_mode != MergeMode::fast
+        && options.merge_mode != MergeMode::max)
+        throw invalid_argument("decoder snapshot with an unknown merge mode");
+    options.blank_skip_threshold = reader.read<float>();
+    options.beam_threshold = reader.read<float>();
+    options.num_expansion_threads = reader.read<uint64_t>();
+    options.segment_blank_frames = reader.read<uint64_t>();
+    options.segment_blank_threshold = reader.read<float>();
+    options.max_uncommitted_frames = reader.read<uint64_t>();
+    options.endpoint_blank_frames = reader.read<uint64_t>();
+    options.endpoint_blank_threshold = reader.read<float>();
+    options.endpoint_score_margin = reader.read<float>();
+    string lexicon = reader.read_string();
+    if (!lexicon.empty())
+        options.lexicon = Lexicon::load(lexicon);
+    string language_model = reader.read_string();
+    if (!language_model.empty())
+    {
+        // every label takes at least its size, which bounds their number before allocating them
+        uint64_t num_labels = reader.read<uint64_t>();
+        if (num_labels > reader.remaining() / sizeof(uint64_t))
+            throw invalid_argument("truncated decoder snapshot");
+        vector<string> labels(num_labels);
+        for (auto& label : labels)
+        {
+            label = reader.read_string();
+        }
+        int separator_id = reader.read<int32_t>();
+        options.language_model = LanguageModel::load(language_model, labels, separator_id);
+    }
+    options.lm_alpha = reader.read<float>();
+    options.lm_beta = reader.read<float>();
+    return options;
+}
+
+DecoderOptions read_snapshot_options(const string& snapshot, SnapshotKind kind)
+{
+    SnapshotReader reader(snapshot);
+    return read_snapshot_header(reader, kind);
+}
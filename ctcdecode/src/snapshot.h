@@ -0,0 +1,132 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "decoder_options.h"
+
+/* Binary snapshots of decoder states, to move live streams between processes.
+ * Values are written as they are laid out in memory, so a snapshot can only be
+ * restored on a host of the same byte order, by the same version of the
+ * library, which the header of every snapshot checks.
+ */
+class SnapshotWriter
+{
+    std::string data;
+
+public:
+    template <typename T>
+    void write(const T& value)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain values can be written as they are");
+        data.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    template <typename T>
+    void write_vector(const std::vector<T>& values)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain values can be written as they are");
+        write<uint64_t>(values.size());
+        data.append(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+    }
+
+    void write_string(const std::string& value)
+    {
+        write<uint64_t>(value.size());
+        data.append(value);
+    }
+
+    // the snapshot written so far, the writer is empty afterwards
+    std::string release()
+    {
+        std::string released;
+        released.swap(data);
+        return released;
+    }
+};
+
+// Reads what a SnapshotWriter wrote, throwing std::invalid_argument if the data ends early
+class SnapshotReader
+{
+    const char* pos;
+    const char* end;
+
+    void require(uint64_t num_bytes) const
+    {
+        if (remaining() < num_bytes)
+            throw std::invalid_argument("truncated decoder snapshot");
+    }
+
+public:
+    SnapshotReader(const std::string& data)
+        : pos(data.data())
+        , end(data.data() + data.size())
+    {}
+
+    template <typename T>
+    T read()
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain values can be read as they are");
+        require(sizeof(T));
+        T value;
+        std::memcpy(&value, pos, sizeof(T));
+        pos += sizeof(T);
+        return value;
+    }
+
+    template <typename T>
+    void read_vector(std::vector<T>& values)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain values can be read as they are");
+        uint64_t size = read<uint64_t>();
+        // checked before multiplying, a corrupt size may overflow
+        if (size > remaining() / sizeof(T))
+            throw std::invalid_argument("truncated decoder snapshot");
+        values.resize(size);
+        // data() may be null for an empty vector, which memcpy doesn't allow even for 0 bytes
+        if (size > 0)
+            std::memcpy(values.data(), pos, size * sizeof(T));
+        pos += size * sizeof(T);
+    }
+
+    std::string read_string()
+    {
+        uint64_t size = read<uint64_t>();
+        require(size);
+        std::string value(pos, size);
+        pos += size;
+        return value;
+    }
+
+    // bytes left to read
+    uint64_t remaining() const
+    {
+        return static_cast<uint64_t>(end - pos);
+    }
+
+    bool at_end() const
+    {
+        return pos == end;
+    }
+};
+
+// What a snapshot holds
+enum class SnapshotKind : uint8_t
+{
+    trie_state,
+    hashed_state,
+    stream,
+};
+
+// Magic number, format version, kind and options, which every snapshot starts with
+void write_snapshot_header(SnapshotWriter& writer, SnapshotKind kind, const DecoderOptions& options);
+
+// Check the header of a snapshot of the given kind and return its options
+DecoderOptions read_snapshot_header(SnapshotReader& reader, SnapshotKind kind);
+
+// options of a snapshot, read from its header
+DecoderOptions read_snapshot_options(const std::string& snapshot, SnapshotKind kind);
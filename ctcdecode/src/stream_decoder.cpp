@@ -0,0 +1,196 @@
+#include "stream_decoder.h"
+
+#include <cmath>
+#include <stdexcept>
+#include <utility>
+
+#include "snapshot.h"
+
+using namespace std;
+
+StreamDecoder::StreamDecoder(const DecoderOptions& options)
+    : options(options)
+{
+    start_segment();
+}
+
+StreamDecoder::StreamDecoder(const string& snapshot)
+    : options(read_snapshot_options(snapshot, SnapshotKind::stream))
+{
+    SnapshotReader reader(snapshot);
+    read_snapshot_header(reader, SnapshotKind::stream);
+    num_classes = reader.read<uint64_t>();
+    num_frames = reader.read<uint64_t>();
+    segment_begin = reader.read<uint64_t>();
+    blank_run = reader.read<uint64_t>();
+    num_popped = reader.read<uint64_t>();
+    const string state = reader.read_string();
+    if (segment_begin > num_frames || !reader.at_end())
+        throw invalid_argument("corrupt decoder snapshot");
+
+    if (options.engine == BeamEngine::hashed)
+        hashed_state.reset(new HashedDecoderState(state, &workspace));
+    else
+        trie_state.reset(new DecoderState(state, &workspace));
+    if (num_popped > committed_timesteps().size())
+        throw invalid_argument("corrupt decoder snapshot");
+}
+
+void StreamDecoder::start_segment()
+{
+    // the previous state hands the workspace back first, the new one reuses its memory
+    trie_state.reset();
+    hashed_state.reset();
+    if (options.engine == BeamEngine::hashed)
+        hashed_state.reset(new HashedDecoderState(options, &workspace));
+    else
+        trie_state.reset(new DecoderState(options, &workspace));
+
+    segment_begin = num_frames;
+    blank_run = 0;
+    num_popped = 0;
+}
+
+void StreamDecoder::feed(const LogProbsView& frames)
+{
+    if (frames.size() == 0)
+        return;
+
+    if (hashed_state)
+        hashed_state->next(frames);
+    else
+        trie_state->next(frames);
+    num_frames += frames.size();
+}
+
+void StreamDecoder::next(const LogProbsView& chunk, vector<StreamSegment>& segments)
+{
+    if (num_frames > 0 && chunk.num_classes != num_classes)
+        throw invalid_argument("every chunk must have the same number of classes");
+    if (chunk.size() == 0)
+        return;
+    num_classes = chunk.num_classes;
+
+    size_t begin = 0;
+    if (options.endpoint_blank_frames > 0 && options.blank_id < chunk.num_classes)
+    {
+        // the beam only needs to be looked at when a pause is long enough, or again as long as it goes on
+        const float log_threshold = log(options.endpoint_blank_threshold);
+        for (size_t t = 0; t < chunk.size(); ++t)
+        {
+            blank_run = chunk(t, options.blank_id) >= log_threshold ? blank_run + 1 : 0;
+            if (blank_run == 0 || blank_run % options.endpoint_blank_frames != 0)
+                continue;
+
+            feed(chunk.frames(begin, t + 1));
+            begin = t + 1;
+            check_endpoint(segments);
+        }
+    }
+    feed(chunk.frames(begin, chunk.size()));
+}
+
+void StreamDecoder::check_endpoint(vector<StreamSegment>& segments)
+{
+    const vector<Output> tails = decode_best(2, true);
+    const vector<int>& committed = committed_timesteps();
+
+    // frame of the last token of the best path, whose tail starts after the committed tokens
+    bool has_tokens = true;
+    size_t last_timestep = 0;
+    if (!tails[0].timesteps.empty())
+        last_timestep = tails[0].timesteps.back();
+    else if (!committed.empty())
+        last_timestep = committed.back() + segment_begin;
+    else
+        has_tokens = false;
+
+    // a token in the pause means the best path is still moving
+    if (has_tokens && last_timestep + options.endpoint_blank_frames >= num_frames)
+        return;
+    // and a close second that the beam may still switch to, scores being negative log probabilities
+    if (tails.size() > 1 && tails[1].score - tails[0].score < options.endpoint_score_margin)
+        return;
+
+    if (has_tokens)
+    {
+        StreamSegment segment;
+        segment.begin_frame = segment_begin;
+        segment.end_frame = num_frames;
+        segment.outputs = decode();
+        segments.push_back(move(segment));
+    }
+    start_segment();
+}
+
+const vector<int>& StreamDecoder::committed_timesteps() const
+{
+    return hashed_state ? hashed_state->get_committed_timesteps() : trie_state->get_committed_timesteps();
+}
+
+vector<Output> StreamDecoder::offset_timesteps(vector<Output> outputs) const
+{
+    for (auto& output : outputs)
+    {
+        for (int& timestep : output.timesteps)
+            timestep += static_cast<int>(segment_begin);
+    }
+    return outputs;
+}
+
+vector<Output> StreamDecoder::decode() const
+{
+    return offset_timesteps(hashed_state ? hashed_state->decode() : trie_state->decode());
+}
+
+vector<Output> StreamDecoder::decode_uncommitted() const
+{
+    return offset_timesteps(hashed_state ? hashed_state->decode_uncommitted() : trie_state->decode_uncommitted());
+}
+
+vector<Output> StreamDecoder::decode_best(size_t num_results, bool uncommitted_only) const
+{
+    return offset_timesteps(
+        hashed_state ? hashed_state->decode_best(num_results, uncommitted_only)
+                     : trie_state->decode_best(num_results, uncommitted_only));
+}
+
+Lattice StreamDecoder::decode_lattice() const
+{
+    Lattice lattice = hashed_state ? hashed_state->decode_lattice() : trie_state->decode_lattice();
+    for (int& timestep : lattice.timesteps)
+        timestep += static_cast<int>(segment_begin);
+    return lattice;
+}
+
+void StreamDecoder::pop_committed(vector<int>& tokens, vector<int>& timesteps)
+{
+    const vector<int>& committed_tokens
+        = hashed_state ? hashed_state->get_committed_tokens() : trie_state->get_committed_tokens();
+    const vector<int>& committed = committed_timesteps();
+
+    tokens.insert(tokens.end(), committed_tokens.begin() + num_popped, committed_tokens.end());
+    for (size_t i = num_popped; i < committed.size(); ++i)
+        timesteps.push_back(committed[i] + static_cast<int>(segment_begin));
+    num_popped = committed_tokens.size();
+}
+
+void StreamDecoder::reset()
+{
+    num_classes = 0;
+    num_frames = 0;
+    start_segment();
+}
+
+string StreamDecoder::snapshot() const
+{
+    SnapshotWriter writer;
+    write_snapshot_header(writer, SnapshotKind::stream, options);
+    writer.write<uint64_t>(num_classes);
+    writer.write<uint64_t>(num_frames);
+    writer.write<uint64_t>(segment_begin);
+    writer.write<uint64_t>(blank_run);
+    writer.write<uint64_t>(num_popped);
+    writer.write_string(hashed_state ? hashed_state->snapshot() : trie_state->snapshot());
+    return writer.release();
+}
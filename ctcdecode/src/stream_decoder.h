@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ctc_beam_search_decoder.h"
+#include "decoder_options.h"
+#include "hashed_beam_search.h"
+#include "log_probs_view.h"
+#include "output.h"
+
+// Results of a part of a stream that ended with an endpoint, timesteps counted from the start of the stream
+struct StreamSegment
+{
+    size_t begin_frame = 0;
+    size_t end_frame = 0;
+    std::vector<Output> outputs;
+};
+
+/* Beam search of a stream fed chunk by chunk, with the engine picked by the
+ * options, and endpointing.
+ *
+ * With options.endpoint_blank_frames set, the decoder watches for a pause: a
+ * run of at least that many frames whose blank probability reaches
+ * options.endpoint_blank_threshold, during which the best path hasn't changed,
+ * and after which it leads the second best by options.endpoint_score_margin.
+ * The results of the frames so far are then final. They are returned as a
+ * StreamSegment, and the search starts over from an empty prefix in the same
+ * workspace. The memory and the cost per frame of a stream thus stay flat,
+ * however long it lasts. Pauses before anything was recognized restart the
+ * search without a segment.
+ */
+class StreamDecoder
+{
+    DecoderOptions options;
+    // reused by the state of every segment
+    DecoderWorkspace workspace;
+    std::unique_ptr<DecoderState> trie_state;
+    std::unique_ptr<HashedDecoderState> hashed_state;
+
+    size_t num_classes = 0;
+    size_t num_frames = 0;
+    // first frame of the current segment
+    size_t segment_begin = 0;
+    // trailing frames with a confident blank
+    size_t blank_run = 0;
+    // committed tokens of the current segment already handed out by pop_committed
+    size_t num_popped = 0;
+
+    void start_segment();
+    void feed(const LogProbsView& frames);
+    void check_endpoint(std::vector<StreamSegment>& segments);
+    const std::vector<int>& committed_timesteps() const;
+    // count the timesteps of outputs of the current segment from the start of the stream
+    std::vector<Output> offset_timesteps(std::vector<Output> outputs) const;
+
+public:
+    StreamDecoder(const DecoderOptions& options);
+
+    /* Restore a decoder from snapshot(), possibly taken in another process.
+     * Decoding goes on exactly as it would have in the decoder the snapshot
+     * was taken of, which is far cheaper than decoding the stream again.
+     * Throws std::invalid_argument if the snapshot is corrupt.
+     */
+    StreamDecoder(const std::string& snapshot);
+    StreamDecoder(const StreamDecoder&) = delete;
+    StreamDecoder& operator=(const StreamDecoder&) = delete;
+
+    /* Decode the next frames of the stream, appending the segments they end
+     * to segments. Every chunk must have the same number of classes.
+     */
+    void next(const LogProbsView& chunk, std::vector<StreamSegment>& segments);
+
+    // n-best of the current segment, see DecoderState::decode
+    std::vector<Output> decode() const;
+
+    // n-best of the current segment without its committed tokens, see DecoderState::decode_uncommitted
+    std::vector<Output> decode_uncommitted() const;
+
+    // num_results best candidates of the current segment, see DecoderState::decode_best
+    std::vector<Output> decode_best(size_t num_results, bool uncommitted_only = false) const;
+
+    // candidates of decode() as a prefix tree, see DecoderState::decode_lattice
+    Lattice decode_lattice() const;
+
+    // append the tokens of the current segment committed since the last call
+    void pop_committed(std::vector<int>& tokens, std::vector<int>& timesteps);
+
+    // forget the frames seen so far and start a new stream
+    void reset();
+
+    // compact binary copy of the decoder, its options and the state of the current segment
+    std::string snapshot() const;
+
+    // frames of the stream so far
+    size_t get_num_frames() const
+    {
+        return num_frames;
+    }
+
+    // classes of the chunks, 0 before the first one
+    size_t get_num_classes() const
+    {
+        return num_classes;
+    }
+
+    size_t get_segment_begin() const
+    {
+        return segment_begin;
+    }
+};
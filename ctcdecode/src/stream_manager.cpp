@@ -0,0 +1,301 @@
+#include "stream_manager.h"
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <iterator>
+#include <stdexcept>
+#include <utility>
+
+using namespace std;
+
+struct StreamManager::Stream
+{
+    StreamDecoder decoder;
+    size_t num_classes = 0;
+
+    // chunks waiting for the next batch, and the ones of the batch in flight, row-major
+    vector<vector<float>> queued;
+    vector<vector<float>> decoding;
+    bool is_ready = false;
+    bool in_batch = false;
+    bool finishing = false;
+    // finishing was set when the batch in flight was formed
+    bool last_batch = false;
+
+    Stream(const DecoderOptions& options)
+        : decoder(options)
+    {}
+
+    Stream(const string& snapshot)
+        : decoder(snapshot)
+        , num_classes(decoder.get_num_classes())
+    {}
+};
+
+StreamManager::StreamManager(
+    const DecoderOptions& options,
+    size_t max_batch_streams,
+    size_t num_processes,
+    size_t max_results,
+    function<void(const StreamResult&)> on_result)
+    : options(options)
+    , max_batch_streams(max_batch_streams)
+    , num_processes(num_processes)
+    , max_results(max_results)
+    , on_result(move(on_result))
+{
+    if (max_batch_streams == 0)
+        throw invalid_argument("max_batch_streams must be positive");
+    if (num_processes == 0)
+        throw invalid_argument("num_processes must be positive");
+
+    scheduler = thread([this] { schedule(); });
+}
+
+StreamManager::~StreamManager()
+{
+    {
+        lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    work_ready.notify_all();
+    scheduler.join();
+}
+
+void StreamManager::push(int64_t stream_id, const LogProbsView& chunk)
+{
+    if (chunk.num_classes == 0)
+        throw invalid_argument("chunks must have at least one class");
+
+    // copy outside of the lock, the caller may reuse its buffer as soon as this returns
+    vector<float> data(chunk.size() * chunk.num_classes);
+    for (size_t t = 0; t < chunk.size(); ++t)
+    {
+        for (size_t c = 0; c < chunk.num_classes; ++c)
+            data[t * chunk.num_classes + c] = chunk(t, c);
+    }
+
+    lock_guard<std::mutex> lock(mutex);
+    auto& stream = streams[stream_id];
+    if (stream == nullptr)
+        stream.reset(new Stream(options));
+    else if (stream->finishing)
+        throw invalid_argument("stream " + to_string(stream_id) + " was finished");
+    else if (stream->num_classes != 0 && stream->num_classes != chunk.num_classes)
+        throw invalid_argument("every chunk of a stream must have the same number of classes");
+    // a stream restored before its first frames learns its number of classes here. It is only ever set then,
+    // since a worker may be reading it for a batch the stream is in.
+    if (stream->num_classes == 0)
+        stream->num_classes = chunk.num_classes;
+
+    if (data.empty())
+        return;
+    stream->queued.push_back(move(data));
+    if (!stream->is_ready && !stream->in_batch)
+    {
+        stream->is_ready = true;
+        ready.push_back(stream_id);
+        work_ready.notify_one();
+    }
+}
+
+void StreamManager::finish(int64_t stream_id)
+{
+    lock_guard<std::mutex> lock(mutex);
+    auto it = streams.find(stream_id);
+    if (it == streams.end())
+        throw invalid_argument("unknown stream " + to_string(stream_id));
+
+    Stream& stream = *it->second;
+    if (stream.finishing)
+        return;
+    stream.finishing = true;
+    // the stream goes through one more batch even without queued chunks, to publish its final results
+    if (!stream.is_ready && !stream.in_batch)
+    {
+        stream.is_ready = true;
+        ready.push_back(stream_id);
+        work_ready.notify_one();
+    }
+}
+
+vector<StreamResult> StreamManager::poll(double timeout)
+{
+    unique_lock<std::mutex> lock(mutex);
+    if (timeout > 0)
+        results_ready.wait_for(lock, chrono::duration<double>(timeout), [this] { return !results.empty(); });
+
+    vector<StreamResult> polled;
+    polled.swap(results);
+    result_index.clear();
+    return polled;
+}
+
+void StreamManager::flush()
+{
+    unique_lock<std::mutex> lock(mutex);
+    batch_done.wait(lock, [this] { return ready.empty() && !batch_running; });
+}
+
+string StreamManager::snapshot(int64_t stream_id)
+{
+    unique_lock<std::mutex> lock(mutex);
+    auto idle = [this, stream_id] {
+        auto it = streams.find(stream_id);
+        return it == streams.end() || (!it->second->is_ready && !it->second->in_batch);
+    };
+    batch_done.wait(lock, idle);
+
+    auto it = streams.find(stream_id);
+    if (it == streams.end())
+        throw invalid_argument("unknown stream " + to_string(stream_id));
+    // the scheduler doesn't touch a stream that isn't ready
+    return it->second->decoder.snapshot();
+}
+
+void StreamManager::restore(int64_t stream_id, const string& snapshot)
+{
+    unique_ptr<Stream> stream(new Stream(snapshot));
+
+    lock_guard<std::mutex> lock(mutex);
+    auto& slot = streams[stream_id];
+    if (slot != nullptr)
+        throw invalid_argument("stream " + to_string(stream_id) + " already exists");
+    slot = move(stream);
+}
+
+size_t StreamManager::num_streams() const
+{
+    lock_guard<std::mutex> lock(mutex);
+    return streams.size();
+}
+
+void StreamManager::schedule()
+{
+    vector<int64_t> batch_ids;
+    vector<Stream*> batch;
+    vector<StreamResult> batch_results;
+    thread_pool& pool = get_thread_pool();
+
+    for (;;)
+    {
+        {
+            unique_lock<std::mutex> lock(mutex);
+            work_ready.wait(lock, [this] { return stop || !ready.empty(); });
+            if (stop)
+                return;
+
+            // every ready stream joins the batch up to its size, the longest waiting first
+            batch_ids.clear();
+            batch.clear();
+            while (!ready.empty() && batch.size() < max_batch_streams)
+            {
+                Stream& stream = *streams[ready.front()];
+                batch_ids.push_back(ready.front());
+                ready.pop_front();
+
+                stream.is_ready = false;
+                stream.in_batch = true;
+                stream.last_batch = stream.finishing;
+                stream.decoding.swap(stream.queued);
+                batch.push_back(&stream);
+            }
+            batch_running = true;
+        }
+
+        batch_results.assign(batch.size(), StreamResult());
+        pool.parallel_for(
+            0,
+            batch.size(),
+            [&](size_t i, size_t) {
+                batch_results[i].stream_id = batch_ids[i];
+                decode(*batch[i], batch_results[i]);
+            },
+            num_processes,
+            [&](size_t i) {
+                size_t num_values = 0;
+                for (auto& chunk : batch[i]->decoding)
+                    num_values += chunk.size();
+                return num_values;
+            });
+
+        if (on_result)
+        {
+            for (auto& result : batch_results)
+                on_result(result);
+        }
+        publish(batch_results);
+    }
+}
+
+void StreamManager::decode(Stream& stream, StreamResult& result)
+{
+    try
+    {
+        for (auto& data : stream.decoding)
+        {
+            LogProbsView chunk(data.data(), data.size() / stream.num_classes, stream.num_classes);
+            stream.decoder.next(chunk, result.segments);
+        }
+        stream.decoding.clear();
+
+        for (auto& segment : result.segments)
+        {
+            if (segment.outputs.size() > max_results)
+                segment.outputs.resize(max_results);
+        }
+        result.outputs = stream.decoder.decode_best(max_results);
+        result.final = stream.last_batch;
+    }
+    catch (const exception& e)
+    {
+        result.error = e.what();
+        result.final = true;
+    }
+    result.num_frames = stream.decoder.get_num_frames();
+}
+
+void StreamManager::publish(vector<StreamResult>& batch_results)
+{
+    {
+        lock_guard<std::mutex> lock(mutex);
+        for (auto& result : batch_results)
+        {
+            auto it = streams.find(result.stream_id);
+            Stream& stream = *it->second;
+            stream.in_batch = false;
+            if (result.final)
+                streams.erase(it);
+            else if (!stream.queued.empty() || stream.finishing)
+            {
+                // chunks arrived during the batch, they go into the next one
+                stream.is_ready = true;
+                ready.push_back(result.stream_id);
+            }
+
+            if (on_result)
+                continue;
+            // a stream not polled since its previous batch only keeps its latest results, and all the segments
+            auto index = result_index.find(result.stream_id);
+            if (index == result_index.end())
+            {
+                result_index[result.stream_id] = results.size();
+                results.push_back(move(result));
+            }
+            else
+            {
+                auto& segments = results[index->second].segments;
+                segments.insert(
+                    segments.end(),
+                    make_move_iterator(result.segments.begin()),
+                    make_move_iterator(result.segments.end()));
+                result.segments.swap(segments);
+                results[index->second] = move(result);
+            }
+        }
+        batch_running = false;
+    }
+    results_ready.notify_all();
+    batch_done.notify_all();
+}
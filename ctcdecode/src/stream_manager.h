@@ -0,0 +1,123 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "decoder_options.h"
+#include "log_probs_view.h"
+#include "output.h"
+#include "stream_decoder.h"
+
+// Results of one stream after some of its chunks have been decoded
+struct StreamResult
+{
+    int64_t stream_id = 0;
+    // number of frames decoded so far
+    size_t num_frames = 0;
+    // the stream was finished, or failed, and is gone from the manager
+    bool final = false;
+    // best candidates of the current segment, timesteps counted from the start of the stream
+    std::vector<Output> outputs;
+    // segments ended by an endpoint since the previous results, with their max_results best candidates
+    std::vector<StreamSegment> segments;
+    // what went wrong if decoding the stream failed
+    std::string error;
+};
+
+/* Beam search of many concurrent streams, e.g. live recognition of thousands
+ * of calls per host, without a thread per stream.
+ *
+ * Chunks of any stream can be pushed from any thread; they are copied and
+ * queued. A scheduler thread collects the streams with queued chunks into a
+ * micro-batch, decodes it on the shared thread pool, and publishes the results,
+ * while the chunks arriving meanwhile gather into the next micro-batch. The
+ * chunks of a stream are always decoded in order, one batch at a time. A chunk
+ * therefore waits for at most the batch in flight and its own batch, whose size
+ * max_batch_streams bounds.
+ */
+class StreamManager
+{
+public:
+    /* Parameters:
+     *     options: Settings of the beam search of every stream.
+     *               segment_blank_frames doesn't apply to streams.
+     *     max_batch_streams: Maximum number of streams in a micro-batch.
+     *     num_processes: Maximum number of threads of the shared pool decoding
+     *                    a micro-batch.
+     *     max_results: Number of candidates in the results of a stream.
+     *     on_result: Called on the scheduler thread with the results of every
+     *                stream of a micro-batch once it's decoded. Results are
+     *                then not queued for poll().
+     */
+    StreamManager(
+        const DecoderOptions& options,
+        size_t max_batch_streams,
+        size_t num_processes,
+        size_t max_results = 1,
+        std::function<void(const StreamResult&)> on_result = nullptr);
+    StreamManager(const StreamManager&) = delete;
+    StreamManager& operator=(const StreamManager&) = delete;
+    ~StreamManager();
+
+    // queue the next frames of a stream, starting it if it's new
+    void push(int64_t stream_id, const LogProbsView& chunk);
+
+    // end a stream once its queued chunks are decoded, its last results are final
+    void finish(int64_t stream_id);
+
+    // latest results of every stream updated since the last call, with all the segments they ended, waiting up to
+    // timeout seconds for one
+    std::vector<StreamResult> poll(double timeout = 0);
+
+    // wait until every queued chunk is decoded
+    void flush();
+
+    /* Snapshot of a stream once its queued chunks are decoded, see
+     * StreamDecoder::snapshot. The stream goes on, e.g. until the process
+     * taking it over has restored it.
+     */
+    std::string snapshot(int64_t stream_id);
+
+    /* Start a stream from a snapshot taken by this manager or another one.
+     * The stream decodes with the options of the snapshot.
+     */
+    void restore(int64_t stream_id, const std::string& snapshot);
+
+    size_t num_streams() const;
+
+private:
+    struct Stream;
+
+    DecoderOptions options;
+    size_t max_batch_streams;
+    size_t num_processes;
+    size_t max_results;
+    std::function<void(const StreamResult&)> on_result;
+
+    mutable std::mutex mutex;
+    // signaled when a stream gets ready, when results are published and when a batch is done
+    std::condition_variable work_ready, results_ready, batch_done;
+    std::unordered_map<int64_t, std::unique_ptr<Stream>> streams;
+    // streams with queued chunks that aren't in the batch in flight, in the order they got ready
+    std::deque<int64_t> ready;
+    bool batch_running = false;
+    bool stop = false;
+
+    // latest unpolled results of each stream, in the order the streams were first updated
+    std::unordered_map<int64_t, size_t> result_index;
+    std::vector<StreamResult> results;
+
+    std::thread scheduler;
+
+    void schedule();
+    void decode(Stream& stream, StreamResult& result);
+    void publish(std::vector<StreamResult>& batch_results);
+};
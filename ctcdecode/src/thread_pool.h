@@ -1,5 +1,17 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
 #include <future>
-#include <queue>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <stdexcept>
 #include <thread>
 #include <vector>
 
@@ -8,34 +20,152 @@ class thread_pool
 private:
     typedef std::packaged_task<void(size_t)> task_type;
 
+    // every worker owns a deque, pops from its front and steals from the back of the others when it runs dry
+    struct worker_queue
+    {
+        std::mutex mutex;
+        std::deque<task_type> tasks;
+    };
+
     std::vector<std::thread> workers;
-    std::queue<task_type> tasks;
+    std::vector<std::unique_ptr<worker_queue>> queues;
+    size_t next_queue = 0;
 
-    // synchronization
+    // synchronization, only used to put idle workers to sleep
     std::mutex queue_mutex;
     std::condition_variable condition;
+    std::atomic<size_t> pending { 0 };
     bool stop = false;
 
+    // items of one parallel_for call, dealt to a few runners which steal from each other once their own run out
+    struct parallel_job
+    {
+        struct slot
+        {
+            std::mutex mutex;
+            std::vector<size_t> items;
+            size_t front = 0, back = 0;
+        };
+
+        std::function<void(size_t, size_t)> fn;
+        std::vector<slot> slots;
+        std::atomic<size_t> remaining;
+
+        std::mutex done_mutex;
+        std::condition_variable done;
+        std::exception_ptr error;
+
+        parallel_job(size_t num_slots, size_t num_items)
+            : slots(num_slots)
+            , remaining(num_items)
+        {}
+
+        bool pop(size_t slot_idx, size_t& item)
+        {
+            // own slot first, from the front, so that items are started in the order they were dealt
+            for (size_t k = 0; k < this->slots.size(); k++)
+            {
+                auto& s = this->slots[(slot_idx + k) % this->slots.size()];
+                std::lock_guard<std::mutex> lock(s.mutex);
+                if (s.front < s.back)
+                {
+                    // thieves take the victim's next item too: with longest-first ordering that keeps the
+                    // remaining makespan short, and the lock is per slot so there is nothing to contend on
+                    item = s.items[s.front++];
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void run(size_t slot_idx, size_t thread_idx)
+        {
+            size_t item;
+            while (this->pop(slot_idx, item))
+            {
+                try
+                {
+                    this->fn(item, thread_idx);
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(this->done_mutex);
+                    if (!this->error)
+                        this->error = std::current_exception();
+                }
+
+                if (--this->remaining == 0)
+                {
+                    std::lock_guard<std::mutex> lock(this->done_mutex);
+                    this->done.notify_all();
+                }
+            }
+        }
+
+        void wait()
+        {
+            std::unique_lock<std::mutex> lock(this->done_mutex);
+            this->done.wait(lock, [this] { return this->remaining == 0; });
+            if (this->error)
+                std::rethrow_exception(this->error);
+        }
+    };
+
+    // pool and index of the worker running on the calling thread, if any
+    static std::pair<const thread_pool*, size_t>& current_worker()
+    {
+        static thread_local std::pair<const thread_pool*, size_t> current { nullptr, 0 };
+        return current;
+    }
+
+    bool try_pop(size_t worker_idx, task_type& task)
+    {
+        for (size_t k = 0; k < this->queues.size(); k++)
+        {
+            auto& queue = *this->queues[(worker_idx + k) % this->queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty())
+                continue;
+
+            if (k == 0)
+            {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            else
+            {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            }
+            --this->pending;
+            return true;
+        }
+        return false;
+    }
+
 public:
     thread_pool(size_t threads)
     {
+        for (size_t i = 0; i < threads; i++)
+            this->queues.emplace_back(new worker_queue);
+
         for (size_t i = 0; i < threads; i++)
         {
             this->workers.emplace_back([this, i] {
+                current_worker() = { this, i };
                 for (;;)
                 {
                     task_type task;
-
+                    if (this->try_pop(i, task))
                     {
-                        std::unique_lock<std::mutex> lock(this->queue_mutex);
-                        this->condition.wait(lock, [this] { return this->stop || this->tasks.size() > 0; });
-                        if (this->stop && this->tasks.empty())
-                            return;
-                        task = std::move(this->tasks.front());
-                        this->tasks.pop();
+                        task(i);
+                        continue;
                     }
 
-                    task(i);
+                    std::unique_lock<std::mutex> lock(this->queue_mutex);
+                    this->condition.wait(lock, [this] { return this->stop || this->pending > 0; });
+                    if (this->stop && this->pending == 0)
+                        return;
                 }
             });
         }
@@ -70,29 +200,71 @@ public:
             if (this->stop)
                 throw std::runtime_error("enqueue on stopped thread_pool");
 
-            this->tasks.push(std::move(task));
+            // tasks spawned by a worker stay on its own queue, others are spread round-robin
+            auto& current = current_worker();
+            auto& queue = *this->queues[current.first == this ? current.second : this->next_queue++ % this->queues.size()];
+            {
+                std::lock_guard<std::mutex> queue_lock(queue.mutex);
+                queue.tasks.push_back(std::move(task));
+            }
+            ++this->pending;
         }
         this->condition.notify_one();
 
         return res;
     }
 
+    /* Call f(i, thread_idx) for every i in [start, end), occupying at most max_parallelism workers at a time.
+     * When cost is given, items are started in order of decreasing cost, so that a long item doesn't start last and
+     * set the latency of the whole call. Called from one of the pool's own workers, the caller takes part in the
+     * work instead of blocking, so nesting parallel_for calls can't deadlock.
+     */
     template <typename F>
-    void parallel_for(size_t start, size_t end, F&& f)
+    void parallel_for(
+        size_t start,
+        size_t end,
+        F&& f,
+        size_t max_parallelism = std::numeric_limits<size_t>::max(),
+        const std::function<size_t(size_t)>& cost = nullptr)
     {
-        if (end - start < 2)
+        auto& current = current_worker();
+        const bool from_worker = current.first == this;
+
+        size_t num_items = end > start ? end - start : 0;
+        size_t num_runners = std::min({ num_items, max_parallelism, this->num_threads() });
+        if (num_runners < 2)
         {
             for (size_t i = start; i < end; i++)
-                f(i, 0);
+                f(i, from_worker ? current.second : 0);
             return;
         }
 
-        std::vector<std::future<void>> futures;
-        for (size_t i = start; i < end; i++)
+        std::vector<size_t> order(num_items);
+        std::iota(order.begin(), order.end(), start);
+        if (cost)
         {
-            futures.push_back(this->enqueue([i, &f](size_t thread_idx) { f(i, thread_idx); }));
+            std::vector<size_t> costs(num_items);
+            for (size_t i = 0; i < num_items; i++)
+                costs[i] = cost(start + i);
+            std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+                return costs[a - start] > costs[b - start];
+            });
         }
-        for (auto& future : futures)
-            future.wait();
+
+        // deal the items round-robin, so that every runner starts with one of the longest
+        auto job = std::make_shared<parallel_job>(num_runners, num_items);
+        job->fn = [&f](size_t i, size_t thread_idx) { f(i, thread_idx); };
+        for (size_t k = 0; k < num_items; k++)
+            job->slots[k % num_runners].items.push_back(order[k]);
+        for (auto& slot : job->slots)
+            slot.back = slot.items.size();
+
+        // the job is shared with the runners, a runner that only starts after everything is done finds no items
+        for (size_t r = from_worker ? 1 : 0; r < num_runners; r++)
+            this->enqueue([job, r](size_t thread_idx) { job->run(r, thread_idx); });
+
+        if (from_worker)
+            job->run(0, current.second);
+        job->wait();
     }
 };
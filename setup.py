@@ -49,7 +49,8 @@ ext_modules = [
         sources=ctc_sources + lib_sources,
         include_dirs=third_party_includes,
         language="c++",
-        extra_compile_args=["-std=c++17"],
+        # without trapping math the compiler may turn the selects of log_sum_exp_fast into vector blends
+        extra_compile_args=["-std=c++17", "-fno-trapping-math"],
         define_macros=[("VERSION_INFO", __version__)],
     ),
 ]
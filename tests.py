@@ -1,5 +1,9 @@
 """Test decoders."""
 
+import os
+import pickle
+import struct
+import tempfile
 import unittest
 from collections.abc import Sequence
 
@@ -8,6 +12,37 @@ import numpy as np
 import ctcdecode
 
 
+def write_lexicon(path: str, words: list[list[int]]) -> None:
+    """Write the words as a trie-shaped ConstFst in the OpenFST binary format, over labels token + 1."""
+    arcs: list[dict[int, int]] = [{}]
+    final = [False]
+    for word in words:
+        state = 0
+        for token in word:
+            if token + 1 not in arcs[state]:
+                arcs[state][token + 1] = len(arcs)
+                arcs.append({})
+                final.append(False)
+            state = arcs[state][token + 1]
+        final[state] = True
+
+    # kExpanded | kAcceptor | kILabelSorted | kOLabelSorted
+    properties = 0x1 | 0x10000 | 0x10000000 | 0x40000000
+    num_arcs = sum(len(state_arcs) for state_arcs in arcs)
+    with open(path, "wb") as f:
+        f.write(struct.pack("<i", 2125659606))
+        for name in [b"const", b"standard"]:
+            f.write(struct.pack("<i", len(name)) + name)
+        f.write(struct.pack("<iiQqqq", 2, 0, properties, 0, len(arcs), num_arcs))
+        pos = 0
+        for state_arcs, is_final in zip(arcs, final):
+            f.write(struct.pack("<fIIII", 0.0 if is_final else float("inf"), pos, len(state_arcs), 0, 0))
+            pos += len(state_arcs)
+        for state_arcs in arcs:
+            for label in sorted(state_arcs):
+                f.write(struct.pack("<iifi", label, label, 0.0, state_arcs[label]))
+
+
 class TestDecoders(unittest.TestCase):
     def setUp(self):
         self.vocab_list = ["'", " ", "a", "b", "c", "d", "_"]
@@ -59,6 +94,465 @@ class TestDecoders(unittest.TestCase):
         self.assertEqual(output_str1, self.beam_search_result[0])
         self.assertEqual(output_str2, self.beam_search_result[1])
 
+    def test_beam_search_decoder_non_contiguous(self):
+        probs_seq = np.log(np.array([self.probs_seq1, self.probs_seq2], dtype=np.float32))
+        decoder = ctcdecode.CTCBeamDecoder(beam_width=self.beam_size, blank_id=self.vocab_list.index("_"))
+        expected = decoder.decode(probs_seq)
+
+        # time-major buffer viewed as batch-major, with every other class column being padding
+        padded = np.zeros((probs_seq.shape[1], probs_seq.shape[0], probs_seq.shape[2] * 2), dtype=np.float32)
+        padded[:, :, ::2] = probs_seq.transpose(1, 0, 2)
+        view = padded.transpose(1, 0, 2)[:, :, ::2]
+        self.assertFalse(view.flags.c_contiguous)
+        self.assertEqual(decoder.decode(view), expected)
+
+    def test_beam_search_decoder_async(self):
+        probs_seq = np.log(np.array([self.probs_seq1, self.probs_seq2], dtype=np.float32))
+        decoder = ctcdecode.CTCBeamDecoder(beam_width=self.beam_size, blank_id=self.vocab_list.index("_"))
+        futures = [decoder.decode_async(probs_seq) for _ in range(4)]
+        expected = decoder.decode(probs_seq)
+        decoder.close()
+        self.assertTrue(all(future.done() for future in futures))
+        futures.append(decoder.decode_async(probs_seq))
+        for future in futures:
+            self.assertEqual(future.result(), expected)
+
+    def test_packed_output(self):
+        rng = np.random.default_rng(13)
+        logits = rng.normal(scale=3.0, size=(4, 60, 12)).astype(np.float32)
+        log_probs = logits - np.log(np.exp(logits).sum(axis=2, keepdims=True))
+        seq_lens = np.array([60, 35, 1, 0], dtype=np.int32)
+        decoder = ctcdecode.CTCBeamDecoder(beam_width=16, cutoff_top_n=8)
+        expected = decoder.decode(log_probs, seq_lens)
+
+        packed = decoder.decode_packed(log_probs, seq_lens)
+        num_results = max(len(candidates) for candidates in expected)
+        self.assertEqual(packed.log_probs.shape, (4, num_results))
+        self.assertEqual(packed.lengths.sum(), len(packed.tokens))
+        for b, candidates in enumerate(expected):
+            for i in range(num_results):
+                if i >= len(candidates):
+                    self.assertEqual(packed.lengths[b, i], 0)
+                    self.assertEqual(packed.log_probs[b, i], -np.inf)
+                    continue
+                candidate = packed.candidate(b, i)
+                self.assertEqual(ctcdecode.Candidate(candidate.value, candidate.log_prob), candidates[i])
+                self.assertEqual(len(candidate.timesteps), len(candidate.value))
+
+    def test_lattice_output(self):
+        rng = np.random.default_rng(14)
+        logits = rng.normal(scale=3.0, size=(3, 80, 12)).astype(np.float32)
+        log_probs = logits - np.log(np.exp(logits).sum(axis=2, keepdims=True))
+
+        for engine in ["trie", "hashed"]:
+            decoder = ctcdecode.CTCBeamDecoder(beam_width=16, cutoff_top_n=8, engine=engine)
+            expected = decoder.decode(log_probs)
+            for lattice, candidates in zip(decoder.decode_lattice(log_probs), expected):
+                self.assertEqual(len(lattice.candidates), len(candidates))
+                self.assertLess(len(lattice.tokens), sum(len(c.value) for c in candidates))
+                self.assertTrue(all(parent < node for node, parent in enumerate(lattice.parents)))
+                for i, candidate in enumerate(candidates):
+                    self.assertEqual(lattice.candidate(i)[::2], tuple(candidate))
+
+            stream = decoder.stream()
+            stream.next(log_probs[0])
+            lattice = stream.decode_lattice()
+            self.assertEqual([lattice.candidate(i) for i in range(len(lattice.candidates))], stream.decode())
+
+    def test_shared_thread_pool(self):
+        probs_seq = np.log(np.array([self.probs_seq1], dtype=np.float32))
+        ctcdecode.CTCBeamDecoder(beam_width=self.beam_size, blank_id=self.vocab_list.index("_")).decode(probs_seq)
+        num_threads = ctcdecode.get_num_threads()
+        self.assertGreater(num_threads, 0)
+        ctcdecode.set_num_threads(num_threads)
+        with self.assertRaises(RuntimeError):
+            ctcdecode.set_num_threads(num_threads + 1)
+
+    def test_hashed_engine_matches_trie(self):
+        rng = np.random.default_rng(0)
+        logits = rng.normal(scale=3.0, size=(3, 200, 30)).astype(np.float32)
+        log_probs = logits - np.log(np.exp(logits).sum(axis=2, keepdims=True))
+        for beam_width in (1, 8, 64):
+            trie = ctcdecode.CTCBeamDecoder(beam_width=beam_width, cutoff_top_n=10, engine="trie")
+            hashed = ctcdecode.CTCBeamDecoder(beam_width=beam_width, cutoff_top_n=10, engine="hashed")
+            self.assertEqual(hashed.decode(log_probs), trie.decode(log_probs))
+
+        with self.assertRaises(ValueError):
+            ctcdecode.CTCBeamDecoder(engine="tree")
+
+    def test_cutoff_top_n_large_vocabulary(self):
+        rng = np.random.default_rng(1)
+        log_probs = rng.normal(size=(1, 1, 5000)).astype(np.float32)
+        log_probs[0, 0, 0] = -1e4
+        top = np.argsort(-log_probs[0, 0], kind="stable")[:4]
+        for engine in ("trie", "hashed"):
+            decoder = ctcdecode.CTCBeamDecoder(beam_width=10, cutoff_top_n=4, engine=engine)
+            results = decoder.decode(log_probs)[0]
+            # the blank is pruned as well, which leaves the empty prefix last with no probability
+            self.assertEqual([r.value for r in results], [[int(c)] for c in top] + [[]])
+            self.assertAlmostEqual(results[0].log_prob, float(log_probs[0, 0, top[0]]), places=5)
+
+    def test_fast_merge_mode(self):
+        rng = np.random.default_rng(2)
+        logits = rng.normal(scale=3.0, size=(2, 100, 20)).astype(np.float32)
+        log_probs = logits - np.log(np.exp(logits).sum(axis=2, keepdims=True))
+        exact = ctcdecode.CTCBeamDecoder(beam_width=16, cutoff_top_n=10).decode(log_probs)
+        for engine in ("trie", "hashed"):
+            fast = ctcdecode.CTCBeamDecoder(beam_width=16, cutoff_top_n=10, engine=engine, merge_mode="fast")
+            results = fast.decode(log_probs)
+            for exact_out, fast_out in zip(exact, results):
+                self.assertEqual(fast_out[0].value, exact_out[0].value)
+                self.assertAlmostEqual(fast_out[0].log_prob, exact_out[0].log_prob, places=3)
+
+        with self.assertRaises(ValueError):
+            ctcdecode.CTCBeamDecoder(merge_mode="approximate")
+
+    def test_max_merge_mode(self):
+        # blank, then "a"; "a" is reached by the alignments "aa" (0.42), "a_" (0.18) and "_a" (0.28)
+        log_probs = np.log(np.array([[[0.4, 0.6], [0.3, 0.7]]], dtype=np.float32))
+        for engine in ("trie", "hashed"):
+            exact = ctcdecode.CTCBeamDecoder(beam_width=4, cutoff_top_n=2, engine=engine).decode(log_probs)[0]
+            viterbi = ctcdecode.CTCBeamDecoder(beam_width=4, cutoff_top_n=2, engine=engine, merge_mode="max")
+            results = viterbi.decode(log_probs)[0]
+            self.assertEqual(results[0].value, [1])
+            self.assertAlmostEqual(exact[0].log_prob, np.log(0.88), places=5)
+            self.assertAlmostEqual(results[0].log_prob, np.log(0.42), places=5)
+
+    def test_blank_skip_threshold(self):
+        rng = np.random.default_rng(3)
+        logits = rng.normal(scale=2.0, size=(2, 300, 20)).astype(np.float32)
+        # two out of three runs of frames are confidently blank
+        logits[:, (np.arange(300) // 5) % 3 != 0, 0] += 15.0
+        log_probs = logits - np.log(np.exp(logits).sum(axis=2, keepdims=True))
+        expected = ctcdecode.CTCBeamDecoder(beam_width=16, cutoff_top_n=10).decode(log_probs)
+        for engine in ("trie", "hashed"):
+            decoder = ctcdecode.CTCBeamDecoder(beam_width=16, cutoff_top_n=10, engine=engine, blank_skip_threshold=0.99)
+            for expected_out, out in zip(expected, decoder.decode(log_probs)):
+                self.assertEqual(out[0].value, expected_out[0].value)
+                self.assertAlmostEqual(out[0].log_prob, expected_out[0].log_prob, places=2)
+
+    def test_beam_threshold(self):
+        rng = np.random.default_rng(4)
+        logits = rng.normal(scale=3.0, size=(2, 200, 20)).astype(np.float32)
+        log_probs = logits - np.log(np.exp(logits).sum(axis=2, keepdims=True))
+        expected = ctcdecode.CTCBeamDecoder(beam_width=32, cutoff_top_n=10).decode(log_probs)
+        for engine in ("trie", "hashed"):
+            loose = ctcdecode.CTCBeamDecoder(beam_width=32, cutoff_top_n=10, engine=engine, beam_threshold=1e6)
+            self.assertEqual(loose.decode(log_probs), expected)
+
+            tight = ctcdecode.CTCBeamDecoder(beam_width=32, cutoff_top_n=10, engine=engine, beam_threshold=3.0)
+            for expected_out, out in zip(expected, tight.decode(log_probs)):
+                self.assertEqual(out[0].value, expected_out[0].value)
+                self.assertTrue(all(out[0].log_prob - r.log_prob <= 3.0 for r in out))
+
+            # the best prefix always survives
+            greedy = ctcdecode.CTCBeamDecoder(beam_width=32, cutoff_top_n=10, engine=engine, beam_threshold=0.0)
+            self.assertTrue(all(len(out) > 0 for out in greedy.decode(log_probs)))
+
+        for beam_threshold in (-1.0, float("nan")):
+            with self.assertRaises(ValueError):
+                ctcdecode.CTCBeamDecoder(beam_threshold=beam_threshold)
+
+    def test_parallel_expansion(self):
+        rng = np.random.default_rng(5)
+        logits = rng.normal(scale=2.0, size=(1, 100, 300)).astype(np.float32)
+        log_probs = logits - np.log(np.exp(logits).sum(axis=2, keepdims=True))
+        expected = ctcdecode.CTCBeamDecoder(beam_width=200, cutoff_top_n=50).decode(log_probs)
+        for num_expansion_threads in (2, 3, 8):
+            decoder = ctcdecode.CTCBeamDecoder(
+                beam_width=200, cutoff_top_n=50, num_expansion_threads=num_expansion_threads
+            )
+            self.assertEqual(decoder.decode(log_probs), expected)
+
+    def test_segmented_decoding(self):
+        rng = np.random.default_rng(6)
+        logits = rng.normal(scale=2.0, size=(1, 400, 30)).astype(np.float32)
+        logits[0, np.arange(400), (np.arange(400) // 3) % 30] += 9.0
+        # three long stretches of silence
+        logits[0, np.arange(400) % 100 >= 70, 0] += 20.0
+        log_probs = logits - np.log(np.exp(logits).sum(axis=2, keepdims=True))
+        expected = ctcdecode.CTCBeamDecoder(beam_width=32, cutoff_top_n=10).decode(log_probs)[0]
+        decoder = ctcdecode.CTCBeamDecoder(beam_width=32, cutoff_top_n=10, segment_blank_frames=20)
+        results = decoder.decode(log_probs)[0]
+        self.assertEqual(len(results), len(expected))
+        self.assertEqual(results[0].value, expected[0].value)
+        # every segment starts from a fresh beam, which can only find better alignments than one long beam
+        self.assertAlmostEqual(results[0].log_prob, expected[0].log_prob, delta=0.1)
+
+    def test_streaming_decoder(self):
+        rng = np.random.default_rng(7)
+        logits = rng.normal(scale=3.0, size=(100, 2 * 12)).astype(np.float32)
+        # every other class, so that the chunks are strided views
+        log_probs = (logits - np.log(np.exp(logits).sum(axis=1, keepdims=True)))[:, ::2]
+        decoder = ctcdecode.CTCBeamDecoder(beam_width=16, cutoff_top_n=8)
+        expected = decoder.decode(log_probs[None])[0]
+
+        stream = decoder.stream()
+        for begin, end in [(0, 1), (1, 30), (30, 30), (30, 71), (71, 100)]:
+            stream.next(log_probs[begin:end])
+            if end == 30:
+                partial = stream.decode()
+                self.assertEqual(
+                    [c.value for c in partial], [c.value for c in decoder.decode(log_probs[None, :30])[0]]
+                )
+        self.assertEqual(stream.num_frames, 100)
+
+        results = stream.decode()
+        self.assertEqual([c.value for c in results], [c.value for c in expected])
+        self.assertEqual([c.log_prob for c in results], [c.log_prob for c in expected])
+        for candidate in results:
+            self.assertEqual(len(candidate.timesteps), len(candidate.value))
+            self.assertEqual(candidate.timesteps, sorted(candidate.timesteps))
+
+        stream.reset()
+        self.assertEqual(stream.num_frames, 0)
+        stream.next(log_probs)
+        self.assertEqual([c.value for c in stream.decode()], [c.value for c in expected])
+
+    def test_streaming_partial_results(self):
+        rng = np.random.default_rng(12)
+        logits = rng.normal(scale=3.0, size=(120, 12)).astype(np.float32)
+        log_probs = logits - np.log(np.exp(logits).sum(axis=1, keepdims=True))
+
+        for engine in ["trie", "hashed"]:
+            stream = ctcdecode.CTCBeamDecoder(beam_width=16, cutoff_top_n=8, engine=engine).stream()
+            for begin in range(0, 120, 20):
+                stream.next(log_probs[begin : begin + 20])
+                # candidates whose scores tie may come out in another order
+                full = stream.decode()
+                for num_results in [1, 4, 100]:
+                    best = stream.decode(num_results=num_results)
+                    self.assertEqual([c.log_prob for c in best], [c.log_prob for c in full[:num_results]])
+                best = stream.decode(num_results=1)[0]
+                tail = stream.decode(uncommitted_only=True, num_results=1)[0]
+                self.assertEqual(tail.value, best.value[len(best.value) - len(tail.value) :])
+
+    def test_streaming_commit(self):
+        rng = np.random.default_rng(9)
+        num_frames = 400
+        logits = rng.normal(size=(num_frames, 12)).astype(np.float32)
+        # a token every fourth frame, blank in between
+        logits[np.arange(0, num_frames, 4), np.arange(num_frames // 4) % 11 + 1] += 8.0
+        logits[np.arange(num_frames) % 4 != 0, 0] += 8.0
+        log_probs = logits - np.log(np.exp(logits).sum(axis=1, keepdims=True))
+
+        decoder = ctcdecode.CTCBeamDecoder(beam_width=16, cutoff_top_n=8)
+        expected = decoder.stream()
+        expected.next(log_probs)
+        expected = expected.decode()
+
+        bounded = ctcdecode.CTCBeamDecoder(beam_width=16, cutoff_top_n=8, max_uncommitted_frames=64)
+        for stream_decoder in [decoder, bounded]:
+            stream = stream_decoder.stream()
+            committed, committed_timesteps = [], []
+            for begin in range(0, num_frames, 50):
+                stream.next(log_probs[begin : begin + 50])
+                tokens, timesteps = stream.pop_committed()
+                committed += tokens
+                committed_timesteps += timesteps
+                for candidate, tail in zip(stream.decode(), stream.decode(uncommitted_only=True)):
+                    self.assertEqual(candidate.value, committed + tail.value)
+                    self.assertEqual(candidate.timesteps, committed_timesteps + tail.timesteps)
+                    self.assertEqual(candidate.log_prob, tail.log_prob)
+
+            results = stream.decode()
+            self.assertEqual(results[0].value[: len(committed)], committed)
+            if stream_decoder is decoder:
+                # committing on agreement alone doesn't change the results
+                self.assertEqual(results, expected)
+            else:
+                self.assertGreater(len(committed), len(results[0].value) - 64 // 4 - 50)
+                self.assertEqual(results[0].value, expected[0].value)
+
+    def test_streaming_endpoints(self):
+        rng = np.random.default_rng(10)
+        num_frames = 600
+        logits = rng.normal(size=(num_frames, 12)).astype(np.float32)
+        # speech with a token every fourth frame, and a pause after every 150 frames, which the last blanks of the
+        # speech already count towards
+        logits[np.arange(0, num_frames, 4), np.arange(num_frames // 4) % 11 + 1] += 8.0
+        logits[np.arange(num_frames) % 4 != 0, 0] += 8.0
+        pause = np.arange(num_frames) % 200 >= 150
+        logits[pause, 0] += 20.0
+        log_probs = logits - np.log(np.exp(logits).sum(axis=1, keepdims=True))
+
+        decoder = ctcdecode.CTCBeamDecoder(beam_width=16, cutoff_top_n=8, endpoint_blank_frames=30)
+        stream = decoder.stream()
+        segments = []
+        for begin in range(0, num_frames, 64):
+            segments += stream.next(log_probs[begin : begin + 64])
+
+        self.assertEqual([(s.begin_frame, s.end_frame) for s in segments], [(0, 179), (179, 379), (379, 579)])
+        self.assertEqual(stream.segment_begin, 579)
+        exact = ctcdecode.CTCBeamDecoder(beam_width=16, cutoff_top_n=8)
+        for segment in segments:
+            expected = exact.decode(log_probs[None, segment.begin_frame : segment.end_frame])[0]
+            self.assertEqual([c.value for c in segment.candidates], [c.value for c in expected])
+            for candidate in segment.candidates:
+                self.assertTrue(all(segment.begin_frame <= t < segment.end_frame - 30 for t in candidate.timesteps))
+        # the frames after the last endpoint are pause only
+        self.assertEqual(stream.decode()[0].value, [])
+
+        # the best candidate never leads by that much, so the stream never ends a segment
+        hesitant = ctcdecode.CTCBeamDecoder(
+            beam_width=16, cutoff_top_n=8, endpoint_blank_frames=30, endpoint_score_margin=1e6
+        ).stream()
+        self.assertEqual(hesitant.next(log_probs), [])
+        self.assertEqual(hesitant.segment_begin, 0)
+
+    def test_stream_manager(self):
+        rng = np.random.default_rng(8)
+        logits = rng.normal(scale=3.0, size=(5, 80, 12)).astype(np.float32)
+        log_probs = logits - np.log(np.exp(logits).sum(axis=2, keepdims=True))
+        decoder = ctcdecode.CTCBeamDecoder(beam_width=16, cutoff_top_n=8)
+        expected = decoder.decode(log_probs)
+
+        manager = decoder.stream_manager(max_batch_streams=2, max_results=3)
+        for begin, end in [(0, 7), (7, 40), (40, 80)]:
+            for stream_id in range(5):
+                manager.push(stream_id, log_probs[stream_id, begin:end])
+        for stream_id in range(5):
+            manager.finish(stream_id)
+        manager.flush()
+
+        updates = {update.stream_id: update for update in manager.poll()}
+        self.assertEqual(sorted(updates), list(range(5)))
+        self.assertEqual(manager.num_streams, 0)
+        for stream_id, update in updates.items():
+            self.assertTrue(update.final)
+            self.assertIsNone(update.error)
+            self.assertEqual(update.num_frames, 80)
+            self.assertEqual([c.value for c in update.candidates], [c.value for c in expected[stream_id][:3]])
+        with self.assertRaises(ValueError):
+            manager.finish(0)
+
+    def test_stream_snapshot(self):
+        rng = np.random.default_rng(11)
+        logits = rng.normal(scale=3.0, size=(200, 12)).astype(np.float32)
+        log_probs = logits - np.log(np.exp(logits).sum(axis=1, keepdims=True))
+
+        for engine in ["trie", "hashed"]:
+            decoder = ctcdecode.CTCBeamDecoder(beam_width=16, cutoff_top_n=8, engine=engine)
+            stream = decoder.stream()
+            stream.next(log_probs[:90])
+            restored = pickle.loads(pickle.dumps(stream))
+            self.assertEqual(restored.num_frames, 90)
+            for decoding in [stream, restored]:
+                decoding.next(log_probs[90:])
+            self.assertEqual(restored.decode(), stream.decode())
+
+            manager = decoder.stream_manager()
+            manager.restore(7, ctcdecode.StreamingDecoder.restore(stream.snapshot()).snapshot())
+            self.assertEqual(manager.snapshot(7), stream.snapshot())
+        with self.assertRaises(ValueError):
+            ctcdecode.StreamingDecoder.restore(stream.snapshot()[:-1])
+
+        # a trie snapshot ends with the numbers of the beam's nodes, make the last one a duplicate
+        stream = ctcdecode.CTCBeamDecoder(beam_width=16, cutoff_top_n=8).stream()
+        stream.next(log_probs[:90])
+        snapshot = stream.snapshot()
+        with self.assertRaises(ValueError):
+            ctcdecode.StreamingDecoder.restore(snapshot[:-4] + snapshot[-8:-4])
+
+    def test_lexicon(self):
+        # "ac" is the best path, but the lexicon only has the words "ab" and "c"
+        log_probs = np.log(np.array([[[0.1, 0.8998, 1e-4, 1e-4], [0.1, 1e-4, 0.3, 0.5999]]], dtype=np.float32))
+        with tempfile.TemporaryDirectory() as directory:
+            path = os.path.join(directory, "lexicon.fst")
+            write_lexicon(path, [[1, 2], [3]])
+
+            self.assertEqual(ctcdecode.CTCBeamDecoder(blank_id=0).decode(log_probs)[0][0].value, [1, 3])
+            for engine in ["trie", "hashed"]:
+                decoder = ctcdecode.CTCBeamDecoder(blank_id=0, engine=engine, lexicon=path)
+                results = decoder.decode(log_probs)
+                self.assertEqual(results[0][0].value, [1, 2])
+
+                stream = decoder.stream()
+                stream.next(log_probs[0, :1])
+                restored = pickle.loads(pickle.dumps(stream))
+                for decoding in [stream, restored]:
+                    decoding.next(log_probs[0, 1:])
+                self.assertEqual(restored.decode(), stream.decode())
+                self.assertEqual(stream.decode()[0].value, [1, 2])
+
+            # the lexicon at the snapshot's path no longer has the state of "ab"
+            snapshot = stream.snapshot()
+            del decoder, stream, restored
+            write_lexicon(path, [[3]])
+            with self.assertRaises(ValueError):
+                ctcdecode.StreamingDecoder.restore(snapshot)
+
+            with self.assertRaises(ValueError):
+                ctcdecode.CTCBeamDecoder(lexicon=path, segment_blank_frames=10)
+
+        with self.assertRaises(ValueError):
+            ctcdecode.CTCBeamDecoder(lexicon=path)
+
+    def test_language_model(self):
+        # "ac" is the best path, but the bigram model makes "ab" far likelier
+        log_probs = np.log(np.array([[[0.1, 0.8998, 1e-4, 1e-4], [0.1, 1e-4, 0.3, 0.5999]]], dtype=np.float32))
+        arpa = """\\data\\
+ngram 1=5
+ngram 2=3
+
+\\1-grams:
+-1.0\t<s>\t-0.5
+-1.0\t</s>
+-0.5\ta\t-0.5
+-0.5\tb\t-0.5
+-0.5\tc\t-0.5
+
+\\2-grams:
+-0.1\t<s> a
+-0.1\ta b
+-3.0\ta c
+
+\\end\\
+"""
+        with tempfile.TemporaryDirectory() as directory:
+            arpa_path = os.path.join(directory, "lm.arpa")
+            binary_path = os.path.join(directory, "lm.bin")
+            with open(arpa_path, "w") as f:
+                f.write(arpa)
+            ctcdecode.convert_language_model(arpa_path, binary_path)
+
+            labels = ["", "a", "b", "c"]
+            self.assertEqual(ctcdecode.CTCBeamDecoder(blank_id=0).decode(log_probs)[0][0].value, [1, 3])
+            results = []
+            for engine in ["trie", "hashed"]:
+                for path in [arpa_path, binary_path]:
+                    decoder = ctcdecode.CTCBeamDecoder(
+                        blank_id=0, engine=engine, model_path=path, labels=labels, alpha=1.0, beta=0.5
+                    )
+                    results.append(decoder.decode(log_probs))
+                    self.assertEqual(results[-1][0][0].value, [1, 2])
+                    self.assertEqual(results[-1], results[0])
+
+                stream = decoder.stream()
+                stream.next(log_probs[0, :1])
+                restored = pickle.loads(pickle.dumps(stream))
+                for decoding in [stream, restored]:
+                    decoding.next(log_probs[0, 1:])
+                self.assertEqual(restored.decode(), stream.decode())
+
+            # word-level: "ba" is the best spelling, but only "ab" is a likely word
+            words_path = os.path.join(directory, "words.arpa")
+            with open(words_path, "w") as f:
+                f.write("\\data\\\nngram 1=2\n\n\\1-grams:\n-0.1\tab\n-3.0\tba\n\n\\end\\\n")
+            word_log_probs = np.log(
+                np.array([[[1e-3, 0.4, 0.599, 0], [1e-3, 0.599, 0.4, 0], [1e-3, 0, 0, 0.999]]], dtype=np.float32) + 1e-6
+            )
+            decoder = ctcdecode.CTCBeamDecoder(
+                blank_id=0, model_path=words_path, labels=["", "a", "b", " "], alpha=1.0, separator_id=3
+            )
+            self.assertEqual(ctcdecode.CTCBeamDecoder(blank_id=0).decode(word_log_probs)[0][0].value, [2, 1, 3])
+            self.assertEqual(decoder.decode(word_log_probs)[0][0].value, [1, 2, 3])
+
+            with self.assertRaises(ValueError):
+                ctcdecode.CTCBeamDecoder(model_path=os.path.join(directory, "none.arpa"), labels=labels)
+            with self.assertRaises(ValueError):
+                ctcdecode.CTCBeamDecoder(model_path=binary_path)
+
 
 if __name__ == "__main__":
     unittest.main()